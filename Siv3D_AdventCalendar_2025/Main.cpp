@@ -1,678 +1,6698 @@
 #include <Siv3D.hpp>
 
+// ENABLE_PROFILER: FrameProfiler の計測・アロケーション回数の計測（operator new の置き換え）・
+// F1〜F3 のオーバーレイを有効にする（Debug ビルドでは指定しなくても有効）
+#if defined(_DEBUG) && !defined(ENABLE_PROFILER)
+#	define ENABLE_PROFILER
+#endif
+
 
 /*
-* Entity Component
+* Asset
 */
 
-// 座標
-struct PosComponent
+// テクスチャのメモリ量の目安（RGBA 8bit、ミップマップなし）
+constexpr size_t TextureBytes(const Size& size)
 {
-	Vec3 pos; // {x,y}: 画面上の位置, z: 描画順
-};
+	return static_cast<size_t>(size.x) * static_cast<size_t>(size.y) * 4;
+}
 
-// 画像表示
-struct ImageComponent
+// AssetCache で共有するテクスチャ
+// texture は AssetCache::update でメインスレッドが作るまで空（描画はその後なので、描くときには入っている）
+struct CachedTexture
 {
+	String path;
 	Texture texture;
-	Size imageSize; // 画像を切り分けるサイズ
-	Point imagePos; // 表示する画像の番号
-	bool isHidden = false; // true のとき非表示
-};
-
-// テキスト表示
-struct TextComponent
-{
-	String text;
-	Font font;
+	Point offset; // texture 内での画像の位置（アトラスにまとめていない場合は 0）
+	Size size; // 画像の大きさ
+	size_t byteSize = 0; // texture のメモリ量の目安（アトラスのページを使う場合は 0、アトラスの方で数える）
+	uint64 batchKey = 0; // 同じテクスチャ（アトラスのページ）を使うものは同じ値（Renderer が描画順をまとめる）
 };
 
-// EntityとComponentの管理
-struct EntitySet
+// テクスチャを同じ大きさに切り分けたもの（AssetCache で共有）
+// 切り分けた範囲は作るときに計算しておき、描画のたびには計算しない
+struct SpriteSheet
 {
-	// Entity名のセット
-	HashSet<String> nameSet;
+	std::shared_ptr<const CachedTexture> texture;
+	Size cellSize;
+	int32 columns; // 横に並んでいる数
+	Array<Rect> cells; // 左上から横順に、texture 内の範囲（アトラス内の位置を含む）
 
-	// 名前 -> Component
-	HashTable<String, PosComponent> posTable;
-	HashTable<String, ImageComponent> imageTable;
-	HashTable<String, TextComponent> textTable;
+	static SpriteSheet Make(const std::shared_ptr<const CachedTexture>& texture, const Size& cellSize)
+	{
+		const Size count = (0 < cellSize.x && 0 < cellSize.y) ? Size{ texture->size.x / cellSize.x, texture->size.y / cellSize.y } : Size{ 0, 0 };
+		SpriteSheet sheet{ texture, cellSize, count.x, {} };
+		sheet.cells.reserve(count.x * count.y);
+		for (int32 y = 0; y < count.y; ++y)
+		{
+			for (int32 x = 0; x < count.x; ++x)
+			{
+				sheet.cells.emplace_back(texture->offset + Point{ x, y } * cellSize, cellSize);
+			}
+		}
+		return sheet;
+	}
 
-	// Entityの削除
-	void erase(const String& name)
+	// imagePos 番目の範囲（シートの外を指す場合はその場で計算する）
+	Rect cell(const Point& imagePos) const
 	{
-		nameSet.erase(name);
-		posTable.erase(name);
-		imageTable.erase(name);
-		textTable.erase(name);
+		if (0 <= imagePos.x && imagePos.x < columns && 0 <= imagePos.y)
+		{
+			if (const size_t i = static_cast<size_t>(imagePos.y) * columns + imagePos.x; i < cells.size())
+			{
+				return cells[i];
+			}
+		}
+		return Rect{ texture->offset + imagePos * cellSize, cellSize };
 	}
 };
 
+// AssetCache で共有するフォント
+// font は AssetCache::update でメインスレッドが作るまで空
+struct CachedFont
+{
+	int32 size;
+	Typeface typeface;
+	Font font;
+
+	// 文字を描いたテクスチャのメモリ量の目安（使った文字が増えると大きくなる）
+	size_t byteSize() const { return TextureBytes(font.getTexture().size()); }
+};
+
 
 /*
-* State
+* Profiler
 */
 
-class State
+// フレームごとの処理時間（区間ごと）・Entity数・アロケーション回数を記録する
+// 直近 HistorySize フレームをリングバッファに残し、重いフレームは別に取っておく
+// ENABLE_PROFILER が無いときは ProfileScope が何もせず、アロケーション回数は常に 0
+class FrameProfiler
 {
 public:
-	struct Action
-	{
-		enum class Type
-		{
-			NONE,
-			POP,
-			PUSH,
-			RESET, // clear + push
-		};
+	static constexpr uint32 MainThread = 0;
+	static constexpr uint32 SimulationThread = 1; // SimulationPipeline のワーカー
 
-		Type type;
-		std::unique_ptr<State> nextState;
+	// 計測区間1つ分
+	struct Event
+	{
+		uint32 zone; // zone() で取得した区間の番号
+		uint32 depth; // 入れ子の深さ
+		uint64 beginUs;
+		uint64 durationUs;
+		uint32 thread = MainThread; // 計測したスレッド
+	};
 
-		static Action None() { return { Type::NONE, nullptr }; }
-		static Action Pop() { return{ Type::POP, nullptr }; }
-		static Action Push(std::unique_ptr<State>&& state) { return{ Type::PUSH, std::move(state) }; }
-		static Action Reset(std::unique_ptr<State>&& state) { return{ Type::RESET, std::move(state) }; }
+	struct Frame
+	{
+		uint64 index = 0; // 何フレーム目か
+		uint64 beginUs = 0;
+		uint64 durationUs = 0;
+		size_t entityCount = 0;
+		uint64 allocCount = 0;
+		Array<Event> events;
 	};
 
-	virtual ~State() = default;
+	static constexpr size_t HistorySize = 240;
+	static constexpr size_t MaxSpikes = 8;
+	static constexpr uint64 SpikeUs = 1'000'000 / 60; // これより長いフレームを取っておく
 
-	virtual void onAfterPush(EntitySet& entities) = 0;
-	virtual Action update(EntitySet& entities) = 0;
-	virtual void onBeforePop(EntitySet& entities) = 0;
+	FrameProfiler();
 
-	virtual String getName() const = 0;
-};
+	// 区間名 -> 区間の番号（同じ名前には同じ番号を返す、どのスレッドから呼んでもよい）
+	uint32 zone(const String& name);
+	String zoneName(uint32 zone) const;
 
+	void beginFrame();
+	void endFrame(size_t entityCount);
 
-/*
-* WaitState
-*/
+	// 区間の開始・終了（ProfileScope から呼ぶ）
+	// メインスレッドとシミュレーションのスレッド以外からの区間は記録しない（NoEvent を返す）
+	static constexpr size_t NoEvent = std::numeric_limits<size_t>::max();
+	size_t begin(uint32 zone);
+	void end(size_t event);
 
-class WaitState : public State
-{
-public:
-	WaitState(const TOMLValue& param);
+	// シミュレーションを進めるスレッド（無いときは std::thread::id{}）
+	void setSimulationThread(std::thread::id id) { m_simulationThread.store(id); }
 
-	void onAfterPush(EntitySet& entities) override;
-	Action update(EntitySet& entities) override;
-	void onBeforePop(EntitySet& entities) override;
+	// シミュレーションのスレッドで記録した区間を今のフレームに移す
+	// シミュレーションのスレッドが止まっている間にメインスレッドから呼ぶ（SimulationPipeline::wait）
+	void collectSimulationEvents();
 
-	String getName() const override
-	{
-		return U"WaitState";
-	}
+	// F1: オーバーレイの表示切替, F2: トレースの書き出し
+	void handleInput();
+	void drawOverlay() const;
+
+	// Chrome の Trace Event Format (chrome://tracing, Perfetto) で書き出す
+	bool exportTrace(FilePathView path) const;
+
+	// operator new から呼ぶ
+	static void CountAlloc() { s_allocCount.fetch_add(1, std::memory_order_relaxed); }
+
+	// 起動してからのアロケーション回数（ENABLE_PROFILER が無いときは 0）
+	static uint64 AllocCount() { return s_allocCount.load(std::memory_order_relaxed); }
 
 private:
-	Timer m_timer;
-};
+	const Frame& lastFrame() const { return m_history[(m_head + HistorySize - 1) % HistorySize]; }
 
-WaitState::WaitState(const TOMLValue& param)
-	: m_timer{ SecondsF(param.get<double>()), StartImmediately::Yes }
-{
-}
+	mutable std::mutex m_zoneMutex; // 区間名はシミュレーションのスレッドからも登録される
+	Array<String> m_zoneNames;
+	HashTable<String, uint32> m_zoneIDs;
 
-void WaitState::onAfterPush(EntitySet&)
-{
-}
+	Array<Frame> m_history; // リングバッファ（Frame.events は使い回す）
+	size_t m_head = 0; // 次に書き込む位置
+	uint64 m_frameCount = 0;
+	uint32 m_depth = 0;
+	uint64 m_allocsAtBegin = 0;
+	std::thread::id m_mainThread = std::this_thread::get_id();
 
-State::Action WaitState::update(EntitySet&)
-{
-	return m_timer.isRunning() ? Action::None() : Action::Pop();
-}
+	// シミュレーションのスレッドの区間は別に溜めておき、collectSimulationEvents で移す
+	std::atomic<std::thread::id> m_simulationThread{};
+	Array<Event> m_simulationEvents;
+	uint32 m_simulationDepth = 0;
 
-void WaitState::onBeforePop(EntitySet&)
-{
-}
+	Array<Frame> m_spikes; // 重かったフレーム（古いものから上書き）
+	size_t m_spikeHead = 0;
 
+	bool m_isOverlayVisible = false;
+	Font m_font{ 12 };
 
-/*
-* SpeakState
-*/
+	inline static std::atomic<uint64> s_allocCount{ 0 };
+};
 
-class SpeakState : public State
+FrameProfiler& GetFrameProfiler()
 {
-public:
-	SpeakState(const TOMLValue& param);
-
-	void onAfterPush(EntitySet& entities) override;
-	Action update(EntitySet& entities) override;
-	void onBeforePop(EntitySet& entities) override;
+	static FrameProfiler profiler;
+	return profiler;
+}
 
-	String getName() const override
+// スコープの間を計測する
+class ProfileScope
+{
+public:
+#ifdef ENABLE_PROFILER
+	explicit ProfileScope(uint32 zone)
+		: m_event{ GetFrameProfiler().begin(zone) }
 	{
-		return U"SpeakState";
 	}
 
+	~ProfileScope() { GetFrameProfiler().end(m_event); }
+#else
+	explicit ProfileScope(uint32) {}
+#endif
+
+	ProfileScope(const ProfileScope&) = delete;
+	ProfileScope& operator=(const ProfileScope&) = delete;
+
 private:
-	const String m_entityName;
-	const String m_text;
-	const Vec2 m_offset;
+#ifdef ENABLE_PROFILER
+	size_t m_event;
+#endif
 };
 
-SpeakState::SpeakState(const TOMLValue& param)
-	: m_entityName{ param[U"entity"].getString() }
-	, m_text{ param[U"text"].getString() }
-	, m_offset{
-		param[U"offset.x"].getOr<double>(0.0),
-		param[U"offset.y"].getOr<double>(0.0)
-	}
+#ifdef ENABLE_PROFILER
+// アロケーション回数を数える
+void* operator new(std::size_t size)
 {
+	FrameProfiler::CountAlloc();
+	if (void* p = std::malloc(size ? size : 1)) { return p; }
+	throw std::bad_alloc{};
 }
 
-void SpeakState::onAfterPush(EntitySet& entities)
-{
-	const auto& entityPosC = entities.posTable.at(m_entityName);
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#endif
 
-	const String name = m_entityName + U"_speak";
-	entities.nameSet.insert(name);
-	entities.posTable[name] = {
-		Vec3{
-			entityPosC.pos.x + m_offset.x,
-			entityPosC.pos.y + m_offset.y,
-			1.0
-		}
-	};
-	entities.textTable[name] = {
-		m_text,
-		Font{ 20 },
-	};
+FrameProfiler::FrameProfiler()
+	: m_history(HistorySize)
+{
+	m_spikes.reserve(MaxSpikes);
 }
 
-State::Action SpeakState::update(EntitySet& entities)
+uint32 FrameProfiler::zone(const String& name)
 {
-	if (KeySpace.down())
+	std::lock_guard lock{ m_zoneMutex };
+	if (auto it = m_zoneIDs.find(name); it != m_zoneIDs.end())
 	{
-		return Action::Pop(); // 決定キーで終了
+		return it->second;
 	}
-	return Action::None();
+
+	const uint32 id = static_cast<uint32>(m_zoneNames.size());
+	m_zoneNames.emplace_back(name);
+	m_zoneIDs.emplace(m_zoneNames.back(), id);
+	return id;
 }
 
-void SpeakState::onBeforePop(EntitySet& entities)
+String FrameProfiler::zoneName(uint32 zone) const
 {
-	entities.erase(m_entityName + U"_speak");
+	std::lock_guard lock{ m_zoneMutex };
+	return m_zoneNames[zone];
 }
 
-
-/*
-* WalkState
-*/
-
-class WalkState : public State
+void FrameProfiler::beginFrame()
 {
-public:
-	WalkState(const TOMLValue& param);
+	Frame& frame = m_history[m_head];
+	frame.index = m_frameCount;
+	frame.events.clear();
+	frame.beginUs = Time::GetMicrosec();
+	m_depth = 0;
+	m_allocsAtBegin = s_allocCount.load(std::memory_order_relaxed);
+}
 
-	void onAfterPush(EntitySet& entities) override;
-	Action update(EntitySet& entities) override;
-	void onBeforePop(EntitySet& entities) override;
+void FrameProfiler::endFrame(size_t entityCount)
+{
+	Frame& frame = m_history[m_head];
+	frame.durationUs = Time::GetMicrosec() - frame.beginUs;
+	frame.entityCount = entityCount;
+	frame.allocCount = s_allocCount.load(std::memory_order_relaxed) - m_allocsAtBegin;
 
-	String getName() const override
+	if (SpikeUs < frame.durationUs)
 	{
-		return U"WalkState";
+		if (m_spikes.size() < MaxSpikes)
+		{
+			m_spikes.push_back(frame);
+		}
+		else
+		{
+			m_spikes[m_spikeHead] = frame;
+		}
+		m_spikeHead = (m_spikeHead + 1) % MaxSpikes;
 	}
 
-private:
-	const String m_entityName;
-	double m_from;
-	const double m_to;
-	const double m_speed;
-	Timer m_timer;
-};
+	m_head = (m_head + 1) % HistorySize;
+	++m_frameCount;
+}
 
-WalkState::WalkState(const TOMLValue& param)
-	: m_entityName{ param[U"entity"].getString() }
-	, m_to{ param[U"to"].get<double>() }
-	, m_from{ 0.0 }
-	, m_speed{ param[U"speed"].get<double>() }
+size_t FrameProfiler::begin(uint32 zone)
 {
+	const auto id = std::this_thread::get_id();
+	if (id == m_mainThread)
+	{
+		auto& events = m_history[m_head].events;
+		events.push_back({ zone, m_depth++, Time::GetMicrosec(), 0, MainThread });
+		return events.size() - 1;
+	}
+	if (id == m_simulationThread.load())
+	{
+		m_simulationEvents.push_back({ zone, m_simulationDepth++, Time::GetMicrosec(), 0, SimulationThread });
+		return m_simulationEvents.size() - 1;
+	}
+	return NoEvent;
 }
 
-void WalkState::onAfterPush(EntitySet& entities)
+void FrameProfiler::end(size_t event)
 {
-	const auto& posC = entities.posTable.at(m_entityName);
-	m_from = posC.pos.x;
-	m_timer = Timer{
-		SecondsF(Abs(m_to - m_from) / m_speed),
-		StartImmediately::Yes
-	};
+	if (event == NoEvent) { return; }
 
-	auto& imageC = entities.imageTable.at(m_entityName);
-	if (m_to < m_from)
+	if (std::this_thread::get_id() == m_mainThread)
 	{
-		imageC.imagePos.x = 1; // 左向き
+		auto& e = m_history[m_head].events[event];
+		e.durationUs = Time::GetMicrosec() - e.beginUs;
+		--m_depth;
 	}
-	else if (m_from < m_to)
+	else
 	{
-		imageC.imagePos.x = 2; // 右向き
+		auto& e = m_simulationEvents[event];
+		e.durationUs = Time::GetMicrosec() - e.beginUs;
+		--m_simulationDepth;
 	}
 }
 
-State::Action WalkState::update(EntitySet& entities)
+void FrameProfiler::collectSimulationEvents()
 {
-	auto& posC = entities.posTable.at(m_entityName);
-	const double t = m_timer.progress0_1();
-	posC.pos.x = (1 - t) * m_from + t * m_to;
-
-	return m_timer.isRunning() ? Action::None() : Action::Pop();
+	auto& events = m_history[m_head].events;
+	events.insert(events.end(), m_simulationEvents.begin(), m_simulationEvents.end());
+	m_simulationEvents.clear();
 }
 
-void WalkState::onBeforePop(EntitySet&)
+void FrameProfiler::handleInput()
 {
+	if (KeyF1.down())
+	{
+		m_isOverlayVisible = not m_isOverlayVisible;
+	}
+
+	if (KeyF2.down())
+	{
+		exportTrace(U"profile_trace.json");
+	}
 }
 
+void FrameProfiler::drawOverlay() const
+{
+	if (not m_isOverlayVisible) { return; }
 
-/*
-* AnimState
-*/
+	const Frame& frame = lastFrame();
 
-class AnimState : public State
-{
-public:
-	AnimState(const TOMLValue& param);
+	RectF{ 0.0, 0.0, 260.0, static_cast<double>(Scene::Height()) }.draw(ColorF{ 0.0, 0.7 });
 
-	void onAfterPush(EntitySet& entities) override;
-	Action update(EntitySet& entities) override;
-	void onBeforePop(EntitySet& entities) override;
+	Vec2 pos{ 8, 8 };
+	m_font(U"frame {:.2f} ms  entities {}  allocs {}"_fmt(
+		frame.durationUs / 1000.0, frame.entityCount, frame.allocCount)).draw(pos, Palette::White);
+	pos.y += 18;
 
-	String getName() const override
+	// メインスレッド、シミュレーションのスレッドの順に
+	for (const uint32 thread : { MainThread, SimulationThread })
 	{
-		return U"AnimState";
-	}
+		if (thread == SimulationThread)
+		{
+			if (not frame.events.any([](const Event& e) { return e.thread == SimulationThread; })) { break; }
+			m_font(U"simulation").draw(pos, Palette::Skyblue);
+			pos.y += 15;
+		}
 
-private:
-	const String m_entityName;
-	const Point m_imagePos;
-	const bool m_isHidden;
-};
+		for (const auto& event : frame.events)
+		{
+			if (event.thread != thread) { continue; }
+			m_font(U"{:.3f} ms {}"_fmt(event.durationUs / 1000.0, zoneName(event.zone)))
+				.draw(pos.movedBy(event.depth * 12, 0), Palette::White);
+			pos.y += 15;
+		}
+	}
 
-AnimState::AnimState(const TOMLValue& param)
-	: m_entityName{ param[U"entity"].getString() }
-	, m_imagePos{
-		param[U"imagePos.x"].get<int32>(),
-		param[U"imagePos.y"].get<int32>()
+	// フレーム時間のグラフ（SpikeUs が高さの半分）
+	const double graphBottom = Scene::Height() - 8.0;
+	const double graphHeight = 60.0;
+	for (size_t i = 0; i < HistorySize; ++i)
+	{
+		const Frame& f = m_history[(m_head + i) % HistorySize];
+		const double h = Min(graphHeight, graphHeight * 0.5 * f.durationUs / SpikeUs);
+		RectF{ 8.0 + i, graphBottom - h, 1.0, h }
+			.draw(SpikeUs < f.durationUs ? Palette::Red : Palette::Limegreen);
 	}
-	, m_isHidden{ param[U"isHidden"].getOr<bool>(false) }
-{
+	m_font(U"spikes {}"_fmt(m_spikes.size())).draw(Vec2{ 8, graphBottom - graphHeight - 16 }, Palette::White);
 }
 
-void AnimState::onAfterPush(EntitySet& entities)
+bool FrameProfiler::exportTrace(FilePathView path) const
 {
-	auto& imageC = entities.imageTable.at(m_entityName);
-	imageC.imagePos = m_imagePos;
-	imageC.isHidden = m_isHidden;
-}
+	TextWriter writer{ path };
+	if (not writer) { return false; }
 
-State::Action AnimState::update(EntitySet&)
-{
-	return Action::Pop();
-}
+	// 名前の " と \ をエスケープする
+	const auto escape = [](const String& s) {
+		String result;
+		for (const auto ch : s)
+		{
+			if (ch == U'"' || ch == U'\\') { result.push_back(U'\\'); }
+			result.push_back(ch);
+		}
+		return result;
+	};
 
-void AnimState::onBeforePop(EntitySet&)
-{
+	bool isFirst = true;
+	const auto writeEvent = [&](const String& json) {
+		writer.write(isFirst ? U"\n" : U",\n");
+		writer.write(json);
+		isFirst = false;
+	};
+
+	const auto writeFrame = [&](const Frame& frame) {
+		writeEvent(U"{{\"name\":\"Frame {}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":1}}"_fmt(
+			frame.index, frame.beginUs, frame.durationUs));
+		for (const auto& e : frame.events)
+		{
+			writeEvent(U"{{\"name\":\"{}\",\"ph\":\"X\",\"ts\":{},\"dur\":{},\"pid\":1,\"tid\":{}}}"_fmt(
+				escape(zoneName(e.zone)), e.beginUs, e.durationUs, e.thread + 1));
+		}
+		writeEvent(U"{{\"name\":\"counts\",\"ph\":\"C\",\"ts\":{},\"pid\":1,\"args\":{{\"entities\":{},\"allocs\":{}}}}}"_fmt(
+			frame.beginUs, frame.entityCount, frame.allocCount));
+	};
+
+	// リングバッファから追い出されたスパイクを先に、その後に直近のフレームを古い順に
+	const uint64 oldest = (HistorySize <= m_frameCount) ? (m_frameCount - HistorySize) : 0;
+	Array<const Frame*> spikes;
+	for (const auto& spike : m_spikes)
+	{
+		if (spike.index < oldest) { spikes.push_back(&spike); }
+	}
+	std::sort(spikes.begin(), spikes.end(), [](const Frame* a, const Frame* b) { return a->index < b->index; });
+
+	writer.write(U"{\"traceEvents\":[");
+	writeEvent(U"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"main\"}}");
+	writeEvent(U"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"simulation\"}}");
+	for (const auto* spike : spikes)
+	{
+		writeFrame(*spike);
+	}
+	const size_t count = static_cast<size_t>(m_frameCount - oldest);
+	for (size_t i = 0; i < count; ++i)
+	{
+		writeFrame(m_history[(m_head + HistorySize - count + i) % HistorySize]);
+	}
+	writer.write(U"\n]}\n");
+	return true;
 }
 
 
 /*
-* AdventureState
+* Input
 */
 
-class AdventureState : public State
+// 操作の種類（キーの割り当ては FrameInput::Sample）
+enum class InputAction : uint8
 {
-public:
-	AdventureState(const TOMLValue& param);
+	DECIDE,
+	LEFT,
+	RIGHT,
+};
+
+constexpr size_t InputActionCount = 3;
+
+// InputAction の集合（ビットで持つ）
+struct InputActions
+{
+	uint8 bits = 0;
+
+	constexpr InputActions() = default;
+	constexpr InputActions(InputAction action) : bits{ static_cast<uint8>(1u << static_cast<uint8>(action)) } {}
 
-	void onAfterPush(EntitySet& entities) override;
-	Action update(EntitySet& entities) override;
-	void onBeforePop(EntitySet& entities) override;
+	constexpr bool contains(InputAction action) const { return intersects(action); }
+	constexpr bool intersects(InputActions other) const { return (bits & other.bits) != 0; }
+	constexpr bool isEmpty() const { return bits == 0; }
 
-	String getName() const override
+	// other に含まれないもの
+	constexpr InputActions without(InputActions other) const
 	{
-		return U"AdventureState";
+		InputActions result;
+		result.bits = static_cast<uint8>(bits & ~other.bits);
+		return result;
 	}
 
-private:
-	const String m_entityName; // 操作するEntity名
-	HashTable<String, String> m_link; // Entity名とシナリオ名を紐づける
+	constexpr InputActions operator|(InputActions other) const
+	{
+		InputActions result;
+		result.bits = static_cast<uint8>(bits | other.bits);
+		return result;
+	}
 
+	InputActions& operator|=(InputActions other) { return *this = *this | other; }
 };
 
-AdventureState::AdventureState(const TOMLValue& param)
-	: m_entityName(param[U"entity"].getString())
+// 1 tick 分の経過時間と操作
+// デバイスはフレームごとに1回だけ読み、State はキーを直接見ずにこれを見る（ベンチマークでは台本から作る）
+struct FrameInput
 {
-	// LinkComponentのようなものをEntityに持たせる方が付け外しが容易
-	// 今回はStateに持たせて楽に済ませる
-	param[U"link"].tableView();
-	for (const auto& [name, value] : param[U"link"].tableView())
+	double deltaTime = 0.0;
+	InputActions down; // この tick で押された操作
+	InputActions pressed; // 押されている操作
+	uint64 frameCount = 0; // 何 tick 目か
+	double time = 0.0; // シミュレーションの時刻（tickSimulation が deltaTime を足していく）
+
+	// 実際の入力から作る
+	static FrameInput Sample()
 	{
-		m_link[name] = value.getString();
-	}
-}
-
-void AdventureState::onAfterPush(EntitySet&)
-{
-}
+		// InputAction の並びと同じ順
+		static const std::array<Input, InputActionCount> ActionKeys{ KeySpace, KeyLeft, KeyRight };
 
-// ScenarioStateを参照するので、Adventure::updateは下で実装
+		FrameInput input{ Scene::DeltaTime() };
+		for (size_t i = 0; i < InputActionCount; ++i)
+		{
+			const auto action = static_cast<InputAction>(i);
+			if (ActionKeys[i].down()) { input.down |= action; }
+			if (ActionKeys[i].pressed()) { input.pressed |= action; }
+		}
+		input.frameCount = static_cast<uint64>(Scene::FrameCount());
+		return input;
+	}
+};
 
-void AdventureState::onBeforePop(EntitySet&)
+// 今の tick の入力（tickSimulation が書き換える）
+FrameInput& GetFrameInput()
 {
+	static FrameInput input;
+	return input;
 }
 
 
 /*
-* ScenarioState
+* Symbol
 */
 
-class ScenarioState : public State
+// 名前（Entity名・シナリオ名）を番号にしたもの
+// シナリオの変換時に SymbolTable で番号にしておき、実行中は整数の比較・ハッシュで済ませる
+struct Symbol
 {
-public:
-	using MakeStateFunc
-		= std::function<std::unique_ptr<State>(const TOMLValue&)>;
+	uint32 id = 0; // 0: 空の名前
 
-	ScenarioState(const String& scenarioName);
-	ScenarioState(const TOMLValue& param);
+	bool isEmpty() const { return id == 0; }
+
+	friend bool operator==(Symbol, Symbol) = default;
+};
 
-	void onAfterPush(EntitySet& entities) override;
-	Action update(EntitySet& entities) override;
-	void onBeforePop(EntitySet& entities) override;
+template<>
+struct std::hash<Symbol>
+{
+	size_t operator()(Symbol symbol) const noexcept { return symbol.id; }
+};
 
-	String getName() const override
+// 名前 <-> Symbol（同じ名前には同じ番号を返す）
+// シナリオの読み込みはメインスレッドとシミュレーションのスレッドの両方で起きるので排他する
+class SymbolTable
+{
+public:
+	SymbolTable()
 	{
-		return U"ScenarioState[[" + m_scenarioName + U"]]";
+		m_names.push_back(std::make_unique<const String>());
+		m_ids.emplace(String{}, 0);
 	}
 
-private:
-	void makeEntities(EntitySet& entities, const TOMLValue& params);
-
-	template<typename Type>
-	MakeStateFunc makeStateFunc()
+	Symbol intern(StringView name)
 	{
-		return [](const TOMLValue& param) {
-			return std::make_unique<Type>(param);
-		};
+		std::lock_guard lock{ m_mutex };
+		if (auto it = m_ids.find(String{ name }); it != m_ids.end())
+		{
+			return { it->second };
+		}
+
+		const uint32 id = static_cast<uint32>(m_names.size());
+		m_names.push_back(std::make_unique<const String>(name));
+		m_ids.emplace(*m_names.back(), id);
+		return { id };
 	}
 
-	// シナリオ管理
-	TOMLTableArrayIterator m_now;
-	TOMLTableArrayIterator m_end;
+	// 返した参照は SymbolTable がある間有効（追加しても名前の文字列は動かない）
+	const String& name(Symbol symbol) const
+	{
+		std::lock_guard lock{ m_mutex };
+		return *m_names[symbol.id];
+	}
 
-	// ここで作ったEntityの名前（pop時に削除する用）
-	HashSet<String> m_nameSetMadeOnThis;
+	size_t size() const
+	{
+		std::lock_guard lock{ m_mutex };
+		return m_names.size();
+	}
 
-	const String m_scenarioName = U"";
+private:
+	mutable std::mutex m_mutex;
+	Array<std::unique_ptr<const String>> m_names; // Symbol.id -> 名前
+	HashTable<String, uint32> m_ids;
 };
 
-ScenarioState::ScenarioState(const String& scenarioName)
-	: m_scenarioName{ scenarioName }
+SymbolTable& GetSymbolTable()
 {
-	static const TOMLReader reader{ U"scenario.toml" };
-	m_now = reader[scenarioName].tableArrayView().begin();
-	m_end = reader[scenarioName].tableArrayView().end();
+	static SymbolTable table;
+	return table;
 }
 
-ScenarioState::ScenarioState(const TOMLValue& param)
-	: ScenarioState{ param.getString() }
-{
-}
 
-void ScenarioState::onAfterPush(EntitySet&)
+/*
+* Entity Component
+*/
+
+// 座標
+struct PosComponent
 {
-}
+	Vec3 pos; // {x,y}: 画面上の位置, z: 描画順
+};
 
-State::Action ScenarioState::update(EntitySet& entities)
+// 画像表示
+struct ImageComponent
 {
-	// 最後まで読んだら pop
-	if (m_now == m_end) { return Action::Pop(); }
+	std::shared_ptr<const SpriteSheet> sheet; // AssetCache で共有
+	Point imagePos; // 表示する画像の番号
+	bool isHidden = false; // true のとき非表示
+	double alpha = 1.0; // 不透明度
+	double scale = 1.0; // 拡大率
 
-	static const HashTable<String, MakeStateFunc> MAKE_TABLE = {
-		{ U"wait", makeStateFunc<WaitState>() },
-		{ U"speak", makeStateFunc<SpeakState>() },
-		{ U"walk", makeStateFunc<WalkState>() },
-		{ U"anim", makeStateFunc<AnimState>() },
-		{ U"adventure", makeStateFunc<AdventureState>() },
-		{ U"scenario", makeStateFunc<ScenarioState>() },
+	// pos に表示したときの範囲
+	RectF bounds(const Vec2& pos) const { return RectF{ Arg::center(pos), sheet->cellSize * scale }; }
+};
+
+// 連番アニメーション（scenario.toml の make に書く）
+// animation = {frames=[{x=1, y=0}, {x=2, y=0}], fps=8, loop="loop"}
+struct AnimationClip
+{
+	enum class Loop
+	{
+		ONCE, // 最後のコマで止まる
+		LOOP,
+		PING_PONG, // 往復する
 	};
 
-	const auto& nowToml = *m_now;
-	++m_now;
+	Array<Point> frames; // imagePos の並び（空ではない）
+	double fps;
+	Loop loop;
 
-	if (nowToml[U"make"].isTableArray())
+	// 再生を始めてから elapsed 秒の時点のコマ
+	const Point& frameAt(double elapsed) const
 	{
-		// Entity作成
-		makeEntities(entities, nowToml[U"make"]);
-		return Action::None();
+		const size_t n = frames.size();
+		const size_t i = static_cast<size_t>(elapsed * fps);
+		switch (loop)
+		{
+		case Loop::ONCE:
+			return frames[Min(i, n - 1)];
+		case Loop::LOOP:
+			return frames[i % n];
+		case Loop::PING_PONG:
+			if (n == 1) { return frames[0]; }
+			const size_t k = i % (2 * n - 2);
+			return frames[(k < n) ? k : (2 * n - 2 - k)];
+		}
+		return frames[0];
 	}
 
-	if (nowToml[U"push"].isString())
+	// elapsed 秒の時点で最後のコマに着いていて、もう変わらない（ONCE のみ）
+	bool isFinished(double elapsed) const
 	{
-		// push
-		const String stateName = nowToml[U"push"].getString();
-		return Action::Push(MAKE_TABLE.at(stateName)(nowToml[U"param"]));
+		return (loop == Loop::ONCE) && (frames.size() <= elapsed * fps);
 	}
+};
 
-	if (nowToml[U"reset"].isString())
-	{
-		// reset
-		const String stateName = nowToml[U"reset"].getString();
-		return Action::Reset(MAKE_TABLE.at(stateName)(nowToml[U"param"]));
-	}
+// アニメーションの再生（ImageComponent の imagePos を updateSystems で書き換える）
+struct AnimationComponent
+{
+	std::shared_ptr<const AnimationClip> clip; // EntityDesc と共有
+	double elapsed = 0.0;
 
-	return Action::None();
-}
+	bool isPlaying() const { return not clip->isFinished(elapsed); }
+};
+
+// テキスト表示
+struct TextComponent
+{
+	// 配置済みの文字1つ
+	struct GlyphQuad
+	{
+		TextureRegion texture; // フォントのテクスチャの一部
+		Vec2 offset; // 表示位置（中心）からの左上の位置
+	};
+
+	using GlyphRun = Array<GlyphQuad>;
+
+	// text を font で整形した結果
+	struct Layout
+	{
+		Vec2 size; // 表示したときの大きさ
+		GlyphRun glyphs;
+	};
+
+	String text;
+	std::shared_ptr<const CachedFont> font; // AssetCache で共有
+	std::shared_ptr<const Layout> layout; // AssetCache::update でメインスレッドが整形するまで空（RenderSnapshot と共有）
+
+	// 整形は AssetCache に頼んで1回だけ行う（text や font を変えるときは作り直す）
+	// AssetCache の後で定義する
+	static TextComponent Make(const String& text, const std::shared_ptr<const CachedFont>& font);
+
+	// 整形する（フォントのテクスチャが更新されるので、メインスレッドで呼ぶ）
+	static Layout Shape(const String& text, const Font& font)
+	{
+		Layout layout{ font(text).region().size, {} };
+
+		const Vec2 origin = layout.size * -0.5;
+		Vec2 pen = origin;
+		for (const auto& glyph : font.getGlyphs(text))
+		{
+			if (glyph.codePoint == U'\n')
+			{
+				pen = Vec2{ origin.x, pen.y + font.height() };
+				continue;
+			}
+			layout.glyphs.push_back({ glyph.texture, pen + glyph.getOffset() });
+			pen.x += glyph.xAdvance;
+		}
+		return layout;
+	}
+
+	// pos を中心に描画する（font(text).drawAt と同じ位置）
+	static void DrawAt(const GlyphRun& glyphs, const Vec2& pos, const ColorF& color)
+	{
+		for (const auto& glyph : glyphs)
+		{
+			glyph.texture.draw(pos + glyph.offset, color);
+		}
+	}
+
+	// pos に表示したときの範囲（整形するまでは大きさ 0）
+	RectF bounds(const Vec2& pos) const { return RectF{ Arg::center(pos), layout->size }; }
+};
+
+// Entityのハンドル
+// index は使いまわすので、generation で削除済みのEntityと区別する
+struct Entity
+{
+	uint32 index = 0;
+	uint32 generation = 0;
+
+	bool operator==(const Entity&) const = default;
+};
+
+// array に count 個追加する分を確保する
+// 少しずつ追加されるときも配り直しが増えないように、足りなければ倍以上に広げる
+template<class T>
+void ReserveAdditional(Array<T>& array, size_t count)
+{
+	const size_t required = array.size() + count;
+	if (array.capacity() < required)
+	{
+		array.reserve(Max(required, array.capacity() * 2));
+	}
+}
+
+// Entity -> 密な配列の番号 の対応（sparse set）
+// Componentの配列は持たず、番号の管理だけをする
+class SparseSet
+{
+public:
+	bool contains(Entity entity) const
+	{
+		if (m_sparse.size() <= entity.index) { return false; }
+		const uint32 dense = m_sparse[entity.index];
+		return dense != NONE && m_entities[dense] == entity;
+	}
+
+	// 密な配列の番号（無い場合は例外）
+	uint32 indexOf(Entity entity) const
+	{
+		if (not contains(entity)) { throw std::out_of_range{ "SparseSet::indexOf" }; }
+		return m_sparse[entity.index];
+	}
+
+	// 末尾に追加して、その番号を返す
+	uint32 add(Entity entity)
+	{
+		if (m_sparse.size() <= entity.index)
+		{
+			m_sparse.resize(entity.index + 1, NONE);
+		}
+		const uint32 dense = static_cast<uint32>(m_entities.size());
+		m_sparse[entity.index] = dense;
+		m_entities.push_back(entity);
+		return dense;
+	}
+
+	// 末尾の要素を削除位置に移して詰める
+	// moveLast(dense, last) で Component の配列も同じように詰めてもらう
+	template<class MoveLast>
+	void remove(Entity entity, MoveLast&& moveLast)
+	{
+		const uint32 dense = indexOf(entity);
+		const uint32 last = static_cast<uint32>(m_entities.size() - 1);
+		if (dense != last)
+		{
+			m_entities[dense] = m_entities[last];
+			m_sparse[m_entities[dense].index] = dense;
+		}
+		moveLast(dense, last);
+		m_entities.pop_back();
+		m_sparse[entity.index] = NONE;
+	}
+
+	// entities のうち持っているものが密な配列の末尾にちょうど並んでいれば、その数
+	// 後から作ったものは末尾に追加されるので、作った順にまとめて削除するときはたいていこちらになる
+	// entities に重複があってもよい（同じ名前で作り直すと同じ Entity が返るので、ScenarioState の一覧に重複しうる）
+	Optional<size_t> countAtTail(const Array<Entity>& entities) const
+	{
+		size_t first = m_entities.size();
+		for (const auto& entity : entities)
+		{
+			if (not contains(entity)) { continue; }
+			first = Min<size_t>(first, m_sparse[entity.index]);
+		}
+		const size_t count = m_entities.size() - first;
+		if (entities.size() < count) { return none; }
+
+		// first から末尾までの全ての番号が entities に含まれているか確かめる
+		Array<bool> isCovered(count, false);
+		size_t coveredCount = 0;
+		for (const auto& entity : entities)
+		{
+			if (not contains(entity)) { continue; }
+			if (auto&& covered = isCovered[m_sparse[entity.index] - first]; not covered)
+			{
+				covered = true;
+				++coveredCount;
+			}
+		}
+		if (coveredCount != count) { return none; }
+		return count;
+	}
+
+	// 末尾の count 個を削除する（countAtTail で調べてから呼ぶ）
+	void popBack(size_t count)
+	{
+		for (size_t i = m_entities.size() - count; i < m_entities.size(); ++i)
+		{
+			m_sparse[m_entities[i].index] = NONE;
+		}
+		m_entities.resize(m_entities.size() - count);
+	}
+
+	void reserve(size_t count) { ReserveAdditional(m_entities, count); }
+
+	// 確保している配列の大きさ
+	size_t byteSize() const { return m_sparse.capacity() * sizeof(uint32) + m_entities.capacity() * sizeof(Entity); }
+
+	size_t size() const { return m_entities.size(); }
+
+	const Array<Entity>& entities() const { return m_entities; }
+
+private:
+	static constexpr uint32 NONE = std::numeric_limits<uint32>::max();
+
+	Array<uint32> m_sparse;
+	Array<Entity> m_entities;
+};
+
+// Componentの格納
+template<class Component>
+class ComponentTable
+{
+public:
+	bool contains(Entity entity) const { return m_index.contains(entity); }
+
+	Component& at(Entity entity) { return m_components[m_index.indexOf(entity)]; }
+	const Component& at(Entity entity) const { return m_components[m_index.indexOf(entity)]; }
+
+	// 既に持っている場合は上書き
+	Component& insert(Entity entity, Component&& component)
+	{
+		++m_version;
+		if (contains(entity))
+		{
+			return at(entity) = std::move(component);
+		}
+		m_index.add(entity);
+		m_components.push_back(std::move(component));
+		return m_components.back();
+	}
+
+	void erase(Entity entity)
+	{
+		if (not contains(entity)) { return; }
+		m_index.remove(entity, [this](uint32 dense, uint32 last) {
+			if (dense != last) { m_components[dense] = std::move(m_components[last]); }
+			m_components.pop_back();
+		});
+		++m_version;
+	}
+
+	// まとめて削除（末尾にまとまっていれば切り詰めるだけ）
+	void erase(const Array<Entity>& entities)
+	{
+		if (const auto count = m_index.countAtTail(entities))
+		{
+			if (*count == 0) { return; }
+			m_index.popBack(*count);
+			m_components.erase(m_components.end() - *count, m_components.end());
+			++m_version;
+			return;
+		}
+		for (const auto& entity : entities)
+		{
+			erase(entity);
+		}
+	}
+
+	// count 個追加する分をまとめて確保する
+	void reserve(size_t count)
+	{
+		m_index.reserve(count);
+		ReserveAdditional(m_components, count);
+	}
+
+	size_t size() const { return m_index.size(); }
+
+	// 確保している配列の大きさ（Component が別に持っているものは含まない）
+	size_t byteSize() const { return m_index.byteSize() + m_components.capacity() * sizeof(Component); }
+
+	// 追加・削除のたびに増える
+	uint64 version() const { return m_version; }
+
+	// 密な配列（先頭から順に走査する用）
+	const Array<Entity>& entities() const { return m_index.entities(); }
+	const Array<Component>& components() const { return m_components; }
+	Array<Component>& components() { return m_components; } // 中身の書き換えだけ（追加・削除はしない）
+
+private:
+	SparseSet m_index;
+	Array<Component> m_components;
+	uint64 m_version = 0;
+};
+
+// PosComponentの格納
+// x, y, z を別々の連続した配列で持つ（structure of arrays）
+class PosTable
+{
+public:
+	bool contains(Entity entity) const { return m_index.contains(entity); }
+
+	PosComponent at(Entity entity) const
+	{
+		const uint32 i = m_index.indexOf(entity);
+		return { Vec3{ m_x[i], m_y[i], m_z[i] } };
+	}
+
+	void insert(Entity entity, const PosComponent& posC)
+	{
+		markMoved(entity);
+
+		if (contains(entity))
+		{
+			const uint32 i = m_index.indexOf(entity);
+			m_x[i] = posC.pos.x;
+			m_y[i] = posC.pos.y;
+			if (m_z[i] != posC.pos.z)
+			{
+				m_z[i] = posC.pos.z;
+				m_isDrawOrderDirty = true;
+			}
+			return;
+		}
+
+		const uint32 i = add(entity);
+		m_x[i] = m_prevX[i] = posC.pos.x;
+		m_y[i] = m_prevY[i] = posC.pos.y;
+		m_z[i] = posC.pos.z;
+		m_isDrawOrderDirty = true;
+	}
+
+	void setX(Entity entity, double x)
+	{
+		double& current = m_x[m_index.indexOf(entity)];
+		if (current != x)
+		{
+			current = x;
+			markMoved(entity);
+		}
+	}
+
+	void setY(Entity entity, double y)
+	{
+		m_y[m_index.indexOf(entity)] = y; // 索引 (SpatialIndex) は x だけなので記録しない
+	}
+
+	// 前の tick の座標も書き換えて、描画で補間せずにその位置に置く（瞬間移動）
+	void teleportX(Entity entity, double x)
+	{
+		setX(entity, x);
+		m_prevX[m_index.indexOf(entity)] = x;
+	}
+
+	void teleportY(Entity entity, double y)
+	{
+		setY(entity, y);
+		m_prevY[m_index.indexOf(entity)] = y;
+	}
+
+	void setZ(Entity entity, double z)
+	{
+		double& current = m_z[m_index.indexOf(entity)];
+		if (current != z)
+		{
+			current = z;
+			m_isDrawOrderDirty = true;
+		}
+	}
+
+	void erase(Entity entity)
+	{
+		if (not contains(entity)) { return; }
+		m_index.remove(entity, [this](uint32 dense, uint32 last) {
+			m_x[dense] = m_x[last]; m_x.pop_back();
+			m_y[dense] = m_y[last]; m_y.pop_back();
+			m_z[dense] = m_z[last]; m_z.pop_back();
+			m_prevX[dense] = m_prevX[last]; m_prevX.pop_back();
+			m_prevY[dense] = m_prevY[last]; m_prevY.pop_back();
+		});
+		m_isDrawOrderDirty = true;
+		markMoved(entity);
+	}
+
+	// まとめて削除（末尾にまとまっていれば切り詰めるだけ）
+	void erase(const Array<Entity>& entities)
+	{
+		const auto count = m_index.countAtTail(entities);
+		if (not count)
+		{
+			for (const auto& entity : entities)
+			{
+				erase(entity);
+			}
+			return;
+		}
+		if (*count == 0) { return; }
+
+		for (size_t i = size() - *count; i < size(); ++i)
+		{
+			markMoved(m_index.entities()[i]);
+		}
+		m_index.popBack(*count);
+		const size_t n = m_index.size();
+		m_x.resize(n);
+		m_y.resize(n);
+		m_z.resize(n);
+		m_prevX.resize(n);
+		m_prevY.resize(n);
+		m_isDrawOrderDirty = true;
+	}
+
+	// count 個追加する分をまとめて確保する
+	void reserve(size_t count)
+	{
+		m_index.reserve(count);
+		ReserveAdditional(m_x, count);
+		ReserveAdditional(m_y, count);
+		ReserveAdditional(m_z, count);
+		ReserveAdditional(m_prevX, count);
+		ReserveAdditional(m_prevY, count);
+	}
+
+	// 全ての Entity で前の tick の座標 = 今の座標（描画で補間しても動かない）
+	bool isSettled() const
+	{
+		return (m_x == m_prevX) && (m_y == m_prevY);
+	}
+
+	// tick の最初に呼び、今の座標を前の tick の座標として取っておく
+	void storePrevious()
+	{
+		m_prevX.assign(m_x.begin(), m_x.end()); // 容量は使いまわす
+		m_prevY.assign(m_y.begin(), m_y.end());
+	}
+
+	// 前の tick の座標
+	Vec2 previous(Entity entity) const
+	{
+		const uint32 i = m_index.indexOf(entity);
+		return { m_prevX[i], m_prevY[i] };
+	}
+
+	// 前の tick の座標から今の座標へ alpha [0, 1] で補間した位置（描画用）
+	Vec2 interpolated(Entity entity, double alpha) const
+	{
+		const uint32 i = m_index.indexOf(entity);
+		return {
+			m_prevX[i] + (m_x[i] - m_prevX[i]) * alpha,
+			m_prevY[i] + (m_y[i] - m_prevY[i]) * alpha,
+		};
+	}
+
+	// 前回 clearMoved してから追加・削除・x の変更があったEntity（重複あり）
+	// 多すぎる場合は記録をやめて isAllMoved が true になる
+	const Array<Entity>& moved() const { return m_moved; }
+	bool isAllMoved() const { return m_isAllMoved; }
+
+	void clearMoved()
+	{
+		m_moved.clear();
+		m_isAllMoved = false;
+	}
+
+	// z の昇順、z が同じものは tieBreak(a, b) の順に並べたEntity（EntitySet::drawOrder から名前順で呼ぶ）
+	// 追加・削除・z の変更があったときだけ並べ直す
+	template<class TieBreak>
+	const Array<Entity>& drawOrder(TieBreak&& tieBreak) const
+	{
+		if (m_isDrawOrderDirty)
+		{
+			m_drawOrder.assign(entities().begin(), entities().end()); // 容量は使いまわす
+			std::sort(m_drawOrder.begin(), m_drawOrder.end(), [&](Entity a, Entity b) {
+				const double za = m_z[m_index.indexOf(a)];
+				const double zb = m_z[m_index.indexOf(b)];
+				return (za != zb) ? (za < zb) : tieBreak(a, b);
+			});
+			m_isDrawOrderDirty = false;
+			++m_drawOrderVersion;
+		}
+		return m_drawOrder;
+	}
+
+	// 描画順を並べ直すたびに増える
+	uint64 drawOrderVersion() const { return m_drawOrderVersion; }
+
+	uint32 indexOf(Entity entity) const { return m_index.indexOf(entity); }
+
+	size_t size() const { return m_index.size(); }
+
+	// 確保している配列の大きさ
+	size_t byteSize() const
+	{
+		return m_index.byteSize()
+			+ (m_x.capacity() + m_y.capacity() + m_z.capacity() + m_prevX.capacity() + m_prevY.capacity()) * sizeof(double)
+			+ (m_drawOrder.capacity() + m_moved.capacity()) * sizeof(Entity);
+	}
+
+	// 密な配列（まとめて処理する用）
+	const Array<Entity>& entities() const { return m_index.entities(); }
+	const Array<double>& xs() const { return m_x; }
+	const Array<double>& ys() const { return m_y; }
+	const Array<double>& zs() const { return m_z; }
+
+private:
+	uint32 add(Entity entity)
+	{
+		const uint32 i = m_index.add(entity);
+		m_x.push_back(0.0);
+		m_y.push_back(0.0);
+		m_z.push_back(0.0);
+		m_prevX.push_back(0.0);
+		m_prevY.push_back(0.0);
+		return i;
+	}
+
+	void markMoved(Entity entity)
+	{
+		if (m_isAllMoved) { return; }
+		if (Max<size_t>(64, size()) <= m_moved.size())
+		{
+			m_moved.clear();
+			m_isAllMoved = true;
+			return;
+		}
+		m_moved.push_back(entity);
+	}
+
+	SparseSet m_index;
+	Array<double> m_x;
+	Array<double> m_y;
+	Array<double> m_z;
+
+	// 前の tick の座標（insert で置いたときは今の座標と同じ）
+	Array<double> m_prevX;
+	Array<double> m_prevY;
+
+	// 描画順のキャッシュ
+	mutable Array<Entity> m_drawOrder;
+	mutable bool m_isDrawOrderDirty = false;
+	mutable uint64 m_drawOrderVersion = 0;
+
+	// 座標の変更の記録
+	Array<Entity> m_moved;
+	bool m_isAllMoved = true;
+};
+
+// セーブデータの読み書き（ScenarioBinary で定義する）
+namespace ScenarioBinary
+{
+	class Encoder;
+	class Decoder;
+}
+
+// 補間できるプロパティ
+enum class TweenProperty : uint8
+{
+	X,
+	Y,
+	Z,
+	ALPHA, // ImageComponent::alpha
+	SCALE, // ImageComponent::scale
+};
+
+constexpr size_t TweenPropertyCount = 5;
+
+// 補間の曲線
+enum class Easing : uint8
+{
+	LINEAR,
+	EASE_IN,
+	EASE_OUT,
+	EASE_IN_OUT,
+};
+
+inline double ApplyEasing(Easing easing, double t)
+{
+	switch (easing)
+	{
+	case Easing::LINEAR:
+		return t;
+	case Easing::EASE_IN:
+		return EaseInQuad(t);
+	case Easing::EASE_OUT:
+		return EaseOutQuad(t);
+	case Easing::EASE_IN_OUT:
+		return EaseInOutQuad(t);
+	}
+	return t;
+}
+
+// Component の値の補間（tween）の格納
+// WalkState・TweenState が追加して、updateSystems でまとめて進める
+// プロパティごとに別の連続した配列で持ち、Entity ごとにプロパティ1つにつき補間は1つ
+class TweenTable
+{
+public:
+	bool contains(Entity entity, TweenProperty property) const { return track(property).index.contains(entity); }
+
+	// いずれかのプロパティを補間している
+	bool contains(Entity entity) const
+	{
+		return std::any_of(m_tracks.begin(), m_tracks.end(), [&](const Track& track) { return track.index.contains(entity); });
+	}
+
+	// 既に補間している場合は上書き
+	void insert(Entity entity, TweenProperty property, double from, double to, double duration, Easing easing)
+	{
+		Track& t = track(property);
+		const uint32 i = t.index.contains(entity) ? t.index.indexOf(entity) : t.add(entity);
+		t.from[i] = from;
+		t.to[i] = to;
+		t.elapsed[i] = 0.0;
+		t.duration[i] = duration;
+		t.easing[i] = easing;
+	}
+
+	void erase(Entity entity, TweenProperty property) { track(property).erase(entity); }
+
+	void erase(Entity entity)
+	{
+		for (auto& t : m_tracks) { t.erase(entity); }
+	}
+
+	size_t size() const
+	{
+		size_t n = 0;
+		for (const auto& t : m_tracks) { n += t.index.size(); }
+		return n;
+	}
+
+	// 確保している配列の大きさ
+	size_t byteSize() const
+	{
+		size_t bytes = 0;
+		for (const auto& t : m_tracks)
+		{
+			bytes += t.index.byteSize()
+				+ (t.from.capacity() + t.to.capacity() + t.elapsed.capacity() + t.duration.capacity() + t.value.capacity()) * sizeof(double)
+				+ t.easing.capacity() * sizeof(Easing);
+		}
+		return bytes;
+	}
+
+	const Array<Entity>& entities(TweenProperty property) const { return track(property).index.entities(); }
+
+	// Component の今の値（Component が無い場合は 0）
+	static double Get(const PosTable& posTable, const ComponentTable<ImageComponent>& imageTable, Entity entity, TweenProperty property)
+	{
+		switch (property)
+		{
+		case TweenProperty::X:
+			return posTable.contains(entity) ? posTable.at(entity).pos.x : 0.0;
+		case TweenProperty::Y:
+			return posTable.contains(entity) ? posTable.at(entity).pos.y : 0.0;
+		case TweenProperty::Z:
+			return posTable.contains(entity) ? posTable.at(entity).pos.z : 0.0;
+		case TweenProperty::ALPHA:
+			return imageTable.contains(entity) ? imageTable.at(entity).alpha : 0.0;
+		case TweenProperty::SCALE:
+			return imageTable.contains(entity) ? imageTable.at(entity).scale : 0.0;
+		}
+		return 0.0;
+	}
+
+	// Component に値を書き込む（Component が無い場合は何もしない）
+	static void Set(PosTable& posTable, ComponentTable<ImageComponent>& imageTable, Entity entity, TweenProperty property, double value)
+	{
+		switch (property)
+		{
+		case TweenProperty::X:
+			if (posTable.contains(entity)) { posTable.setX(entity, value); }
+			return;
+		case TweenProperty::Y:
+			if (posTable.contains(entity)) { posTable.setY(entity, value); }
+			return;
+		case TweenProperty::Z:
+			if (posTable.contains(entity)) { posTable.setZ(entity, value); }
+			return;
+		case TweenProperty::ALPHA:
+			if (imageTable.contains(entity)) { imageTable.at(entity).alpha = value; }
+			return;
+		case TweenProperty::SCALE:
+			if (imageTable.contains(entity)) { imageTable.at(entity).scale = value; }
+			return;
+		}
+	}
+
+	// セーブデータ（SaveData で実装）
+	void save(ScenarioBinary::Encoder& encoder) const;
+	void load(ScenarioBinary::Decoder& decoder);
+
+	// 全ての補間を deltaTime 進めて、Component に書き込む
+	// 終わった補間は削除する
+	void update(PosTable& posTable, ComponentTable<ImageComponent>& imageTable, double deltaTime)
+	{
+		for (size_t p = 0; p < TweenPropertyCount; ++p)
+		{
+			Track& t = m_tracks[p];
+			const size_t n = t.index.size();
+
+			// 補間はEntityをまたいで連続した配列に対する単純なループにする（自動ベクトル化向け）
+			for (size_t i = 0; i < n; ++i)
+			{
+				t.elapsed[i] += deltaTime;
+			}
+			for (size_t i = 0; i < n; ++i)
+			{
+				t.value[i] = (t.elapsed[i] < t.duration[i]) ? (t.elapsed[i] / t.duration[i]) : 1.0;
+			}
+			for (size_t i = 0; i < n; ++i)
+			{
+				if (t.easing[i] != Easing::LINEAR) { t.value[i] = ApplyEasing(t.easing[i], t.value[i]); }
+			}
+			for (size_t i = 0; i < n; ++i)
+			{
+				t.value[i] = (1 - t.value[i]) * t.from[i] + t.value[i] * t.to[i];
+			}
+
+			// 書き戻し
+			const auto property = static_cast<TweenProperty>(p);
+			const auto& tweenEntities = t.index.entities();
+			for (size_t i = 0; i < n; ++i)
+			{
+				Set(posTable, imageTable, tweenEntities[i], property, t.value[i]);
+			}
+
+			// 終わった補間を削除（後ろから見ると詰めても未確認の要素が動かない）
+			for (size_t i = n; 0 < i; --i)
+			{
+				if (t.duration[i - 1] <= t.elapsed[i - 1])
+				{
+					t.erase(tweenEntities[i - 1]);
+				}
+			}
+		}
+	}
+
+private:
+	// プロパティ1つ分
+	struct Track
+	{
+		SparseSet index;
+		Array<double> from;
+		Array<double> to;
+		Array<double> elapsed;
+		Array<double> duration;
+		Array<Easing> easing;
+		Array<double> value; // 補間結果（書き戻し前）
+
+		uint32 add(Entity entity)
+		{
+			const uint32 i = index.add(entity);
+			from.push_back(0.0);
+			to.push_back(0.0);
+			elapsed.push_back(0.0);
+			duration.push_back(0.0);
+			easing.push_back(Easing::LINEAR);
+			value.push_back(0.0);
+			return i;
+		}
+
+		void erase(Entity entity)
+		{
+			if (not index.contains(entity)) { return; }
+			index.remove(entity, [this](uint32 dense, uint32 last) {
+				from[dense] = from[last]; from.pop_back();
+				to[dense] = to[last]; to.pop_back();
+				elapsed[dense] = elapsed[last]; elapsed.pop_back();
+				duration[dense] = duration[last]; duration.pop_back();
+				easing[dense] = easing[last]; easing.pop_back();
+				value[dense] = value[last]; value.pop_back();
+			});
+		}
+	};
+
+	Track& track(TweenProperty property) { return m_tracks[static_cast<size_t>(property)]; }
+	const Track& track(TweenProperty property) const { return m_tracks[static_cast<size_t>(property)]; }
+
+	std::array<Track, TweenPropertyCount> m_tracks;
+};
+
+// x座標で並べた索引（近くにあるEntityの検索用）
+// PosTable の変更の記録から、動いたEntityの位置だけを直す
+class SpatialIndex
+{
+public:
+	// posTable の変更を反映する
+	void update(const PosTable& posTable);
+
+	// minX < x < maxX のEntityを x の昇順に f に渡す
+	template<class F>
+	void query(double minX, double maxX, F&& f) const
+	{
+		auto it = std::upper_bound(m_xs.begin(), m_xs.end(), minX);
+		for (size_t i = std::distance(m_xs.begin(), it); i < m_xs.size() && m_xs[i] < maxX; ++i)
+		{
+			f(m_entities[i]);
+		}
+	}
+
+	// 確保している配列の大きさ
+	size_t byteSize() const
+	{
+		return m_xs.capacity() * sizeof(double) + m_entities.capacity() * sizeof(Entity) + m_slots.capacity() * sizeof(uint32);
+	}
+
+private:
+	static constexpr uint32 NONE = std::numeric_limits<uint32>::max();
+
+	// 索引内の番号（無い場合は NONE）
+	uint32 slotOf(Entity entity) const
+	{
+		if (m_slots.size() <= entity.index) { return NONE; }
+		const uint32 slot = m_slots[entity.index];
+		return (slot != NONE && m_entities[slot] == entity) ? slot : NONE;
+	}
+
+	void rebuild(const PosTable& posTable);
+
+	// markRemoved した番号をまとめて詰める（並び順はそのまま）
+	void markRemoved(uint32 slot);
+	void compact();
+	void insert(Entity entity, double x);
+
+	// 隣と入れ替えながら並び順を直す
+	void sift(uint32 slot);
+	void swapSlots(uint32 a, uint32 b);
+
+	Array<double> m_xs; // 昇順
+	Array<Entity> m_entities;
+	Array<uint32> m_slots; // Entity.index -> 番号
+};
+
+void SpatialIndex::update(const PosTable& posTable)
+{
+	if (posTable.isAllMoved())
+	{
+		rebuild(posTable);
+		return;
+	}
+
+	const auto& moved = posTable.moved();
+
+	// 削除を先に反映する（index が使いまわされている場合があるため）
+	// 1つずつ erase すると後ろを毎回ずらすので、印を付けてから1回で詰める
+	bool isRemoved = false;
+	for (const auto& entity : moved)
+	{
+		if (const uint32 slot = slotOf(entity); slot != NONE && not posTable.contains(entity))
+		{
+			markRemoved(slot);
+			isRemoved = true;
+		}
+	}
+	if (isRemoved)
+	{
+		compact();
+	}
+
+	for (const auto& entity : moved)
+	{
+		if (not posTable.contains(entity)) { continue; }
+
+		const double x = posTable.at(entity).pos.x;
+		if (const uint32 slot = slotOf(entity); slot != NONE)
+		{
+			m_xs[slot] = x;
+			sift(slot);
+		}
+		else
+		{
+			insert(entity, x);
+		}
+	}
+}
+
+void SpatialIndex::rebuild(const PosTable& posTable)
+{
+	Array<std::pair<double, Entity>> items;
+	for (size_t i = 0; i < posTable.size(); ++i)
+	{
+		items.emplace_back(posTable.xs()[i], posTable.entities()[i]);
+	}
+	std::sort(items.begin(), items.end(),
+		[](const auto& a, const auto& b) { return a.first < b.first; });
+
+	m_xs.clear();
+	m_entities.clear();
+	m_slots.assign(m_slots.size(), NONE);
+	for (const auto& [x, entity] : items)
+	{
+		if (m_slots.size() <= entity.index) { m_slots.resize(entity.index + 1, NONE); }
+		m_slots[entity.index] = static_cast<uint32>(m_xs.size());
+		m_xs.push_back(x);
+		m_entities.push_back(entity);
+	}
+}
+
+void SpatialIndex::markRemoved(uint32 slot)
+{
+	m_slots[m_entities[slot].index] = NONE;
+}
+
+void SpatialIndex::compact()
+{
+	uint32 kept = 0;
+	for (uint32 i = 0; i < m_entities.size(); ++i)
+	{
+		const Entity entity = m_entities[i];
+		if (m_slots[entity.index] != i) { continue; } // markRemoved 済み
+
+		m_xs[kept] = m_xs[i];
+		m_entities[kept] = entity;
+		m_slots[entity.index] = kept;
+		++kept;
+	}
+	m_xs.resize(kept);
+	m_entities.resize(kept);
+}
+
+void SpatialIndex::insert(Entity entity, double x)
+{
+	if (m_slots.size() <= entity.index) { m_slots.resize(entity.index + 1, NONE); }
+	const uint32 slot = static_cast<uint32>(m_xs.size());
+	m_slots[entity.index] = slot;
+	m_xs.push_back(x);
+	m_entities.push_back(entity);
+	sift(slot);
+}
+
+void SpatialIndex::sift(uint32 slot)
+{
+	while (0 < slot && m_xs[slot] < m_xs[slot - 1])
+	{
+		swapSlots(slot - 1, slot);
+		--slot;
+	}
+	while (slot + 1 < m_xs.size() && m_xs[slot + 1] < m_xs[slot])
+	{
+		swapSlots(slot, slot + 1);
+		++slot;
+	}
+}
+
+void SpatialIndex::swapSlots(uint32 a, uint32 b)
+{
+	std::swap(m_xs[a], m_xs[b]);
+	std::swap(m_entities[a], m_entities[b]);
+	m_slots[m_entities[a].index] = a;
+	m_slots[m_entities[b].index] = b;
+}
+
+// EntityとComponentの管理
+struct EntitySet
+{
+	// Entity名 -> Entity（TOMLから名前で参照するときだけ使う）
+	HashTable<Symbol, Entity> nameTable;
+
+	// Entity -> Component
+	PosTable posTable;
+	ComponentTable<ImageComponent> imageTable;
+	ComponentTable<TextComponent> textTable;
+	ComponentTable<AnimationComponent> animationTable;
+
+	// 進行中の補間（歩行など）
+	TweenTable tweenTable;
+
+	// minX < x < maxX のEntityを x の昇順に f に渡す
+	template<class F>
+	void queryX(double minX, double maxX, F&& f)
+	{
+		m_spatialIndex.update(posTable);
+		posTable.clearMoved();
+		m_spatialIndex.query(minX, maxX, std::forward<F>(f));
+	}
+
+	// 生きているEntityの数
+	size_t size() const { return nameTable.size(); }
+
+	// 描画順（z の昇順、z が同じものは名前順）
+	const Array<Entity>& drawOrder() const
+	{
+		return posTable.drawOrder([this](Entity a, Entity b) {
+			const String& nameA = *m_nameTexts[a.index];
+			const String& nameB = *m_nameTexts[b.index];
+			return (nameA != nameB) ? (nameA < nameB) : (a.index < b.index);
+		});
+	}
+
+	// State が何もしなくても変わっていくもの（補間・再生中のアニメーション）がある
+	// 最後のコマで止まったアニメーション（loop="once"）は数えない
+	bool isMoving() const
+	{
+		return (tweenTable.size() != 0)
+			|| animationTable.components().any([](const AnimationComponent& animation) { return animation.isPlaying(); });
+	}
+
+	// f(名前, バイト数): 配列ごとのメモリ量の目安（確保している大きさ）
+	// 名前の表は要素と空きを合わせた数で見積もる
+	template<class F>
+	void forEachMemoryUse(F&& f) const
+	{
+		f(U"nameTable", nameTable.bucket_count() * (sizeof(std::pair<const Symbol, Entity>) + 1));
+		f(U"entities", m_generations.capacity() * sizeof(uint32) + m_freeIndices.capacity() * sizeof(uint32) + m_names.capacity() * sizeof(Symbol) + m_nameTexts.capacity() * sizeof(const String*));
+		f(U"posTable", posTable.byteSize());
+		f(U"imageTable", imageTable.byteSize());
+		f(U"textTable", textTable.byteSize());
+		f(U"animationTable", animationTable.byteSize());
+		f(U"tweenTable", tweenTable.byteSize());
+		f(U"spatialIndex", m_spatialIndex.byteSize());
+
+		// 整形済みの文字（TextComponent が共有して持つ）
+		size_t glyphBytes = 0;
+		for (const auto& textC : textTable.components())
+		{
+			if (textC.layout) { glyphBytes += textC.layout->glyphs.capacity() * sizeof(TextComponent::GlyphQuad); }
+		}
+		f(U"textTable.glyphs", glyphBytes);
+	}
+
+	// セーブデータ（SaveData で実装）
+	// Entity の index と世代もそのまま残すので、読み込んだ後も State が持っている Entity が使える
+	void save(ScenarioBinary::Encoder& encoder) const;
+	void load(ScenarioBinary::Decoder& decoder);
+
+	// Entityの作成
+	// 同名のEntityが既にある場合はそれを返す
+	Entity create(Symbol name)
+	{
+		if (auto it = nameTable.find(name); it != nameTable.end())
+		{
+			return it->second;
+		}
+
+		Entity entity;
+		if (m_freeIndices.empty())
+		{
+			entity = { static_cast<uint32>(m_generations.size()), 0 };
+			m_generations.push_back(0);
+			m_names.push_back(name);
+			m_nameTexts.push_back(&GetSymbolTable().name(name));
+		}
+		else
+		{
+			entity.index = m_freeIndices.back();
+			entity.generation = m_generations[entity.index];
+			m_freeIndices.pop_back();
+			m_names[entity.index] = name;
+			m_nameTexts[entity.index] = &GetSymbolTable().name(name);
+		}
+
+		nameTable.emplace(name, entity);
+		return entity;
+	}
+
+	// これから count 個作る分を、名前と各 Component の配列にまとめて確保しておく
+	void reserve(size_t count)
+	{
+		nameTable.reserve(nameTable.size() + count);
+		if (m_freeIndices.size() < count)
+		{
+			ReserveAdditional(m_generations, count - m_freeIndices.size());
+			ReserveAdditional(m_names, count - m_freeIndices.size());
+			ReserveAdditional(m_nameTexts, count - m_freeIndices.size());
+		}
+		posTable.reserve(count);
+		imageTable.reserve(count);
+		textTable.reserve(count);
+		animationTable.reserve(count);
+	}
+
+	// 名前からEntityを取得（無い場合は例外）
+	Entity find(Symbol name) const
+	{
+		return nameTable.at(name);
+	}
+
+	bool isAlive(Entity entity) const
+	{
+		return entity.index < m_generations.size()
+			&& m_generations[entity.index] == entity.generation;
+	}
+
+	// Entityの削除
+	void erase(Entity entity)
+	{
+		if (not isAlive(entity)) { return; }
+
+		nameTable.erase(m_names[entity.index]);
+		posTable.erase(entity);
+		imageTable.erase(entity);
+		textTable.erase(entity);
+		animationTable.erase(entity);
+		tweenTable.erase(entity);
+
+		++m_generations[entity.index]; // 古いハンドルを無効にする
+		m_freeIndices.push_back(entity.index);
+	}
+
+	// まとめて削除
+	// 作った順に並べて渡せば、各 Component の配列は末尾を切り詰めるだけで済む（ScenarioState の pop）
+	void erase(const Array<Entity>& entities)
+	{
+		posTable.erase(entities);
+		imageTable.erase(entities);
+		textTable.erase(entities);
+		animationTable.erase(entities);
+
+		for (const auto& entity : entities)
+		{
+			if (not isAlive(entity)) { continue; } // 重複・削除済み
+
+			nameTable.erase(m_names[entity.index]);
+			tweenTable.erase(entity);
+
+			++m_generations[entity.index];
+			m_freeIndices.push_back(entity.index);
+		}
+	}
+
+private:
+	Array<uint32> m_generations; // Entity.index -> 現在の世代
+	Array<uint32> m_freeIndices; // 再利用できる index
+	Array<Symbol> m_names; // Entity.index -> Entity名
+	Array<const String*> m_nameTexts; // Entity.index -> Entity名の文字列（描画順で比べる用、SymbolTable のものを指す）
+
+	SpatialIndex m_spatialIndex; // queryX のときに更新する
+};
+
+// 全てのアニメーションを deltaTime 進めて、imagePos に書き込む
+void updateAnimations(EntitySet& entities, double deltaTime)
+{
+	const auto& animationEntities = entities.animationTable.entities();
+	auto& animations = entities.animationTable.components();
+	for (size_t i = 0; i < animations.size(); ++i)
+	{
+		auto& animationC = animations[i];
+		animationC.elapsed += deltaTime;
+		if (entities.imageTable.contains(animationEntities[i]))
+		{
+			entities.imageTable.at(animationEntities[i]).imagePos = animationC.clip->frameAt(animationC.elapsed);
+		}
+	}
+}
+
+// Componentをまとめて更新する（StateStack::update の前に呼ぶ）
+void updateSystems(EntitySet& entities, double deltaTime)
+{
+	entities.tweenTable.update(entities.posTable, entities.imageTable, deltaTime);
+	updateAnimations(entities, deltaTime);
+}
+
+// entity の property を duration 秒かけて to にする
+// duration が 0 以下のときは補間を作らずにすぐ書き込む（瞬間移動・表示の切替など）
+void startTween(EntitySet& entities, Entity entity, TweenProperty property, double to, double duration, Easing easing)
+{
+	if (duration <= 0.0)
+	{
+		entities.tweenTable.erase(entity, property);
+		if (property == TweenProperty::X && entities.posTable.contains(entity))
+		{
+			entities.posTable.teleportX(entity, to);
+		}
+		else if (property == TweenProperty::Y && entities.posTable.contains(entity))
+		{
+			entities.posTable.teleportY(entity, to);
+		}
+		else
+		{
+			TweenTable::Set(entities.posTable, entities.imageTable, entity, property, to);
+		}
+		return;
+	}
+
+	const double from = TweenTable::Get(entities.posTable, entities.imageTable, entity, property);
+	entities.tweenTable.insert(entity, property, from, to, duration, easing);
+}
+
+
+/*
+* ScenarioCommand
+*/
+
+// scenario.toml を読み込み時に変換しておいたもの
+// State の作成時には TOML を参照しない
+
+class WaitState;
+class SpeakState;
+class WalkState;
+class AnimState;
+class AdventureState;
+class ScenarioState;
+class ParallelState;
+class TweenState;
+struct CompiledScenario;
+
+struct WaitParam
+{
+	using StateType = WaitState;
+	static WaitParam FromTOML(const TOMLValue& param);
+
+	double seconds;
+};
+
+struct SpeakParam
+{
+	using StateType = SpeakState;
+	static SpeakParam FromTOML(const TOMLValue& param);
+
+	// 吹き出しの Entity 名（entityName + "_speak"）
+	static Symbol SpeakEntityName(Symbol entityName)
+	{
+		return GetSymbolTable().intern(GetSymbolTable().name(entityName) + U"_speak");
+	}
+
+	Symbol entityName;
+	String text;
+	Vec2 offset;
+	Symbol speakEntityName; // 変換時に作っておく（SpeakEntityName）
+};
+
+struct WalkParam
+{
+	using StateType = WalkState;
+	static WalkParam FromTOML(const TOMLValue& param);
+
+	Symbol entityName;
+	double to;
+	double speed;
+};
+
+struct AnimParam
+{
+	using StateType = AnimState;
+	static AnimParam FromTOML(const TOMLValue& param);
+
+	Symbol entityName;
+	Point imagePos;
+	bool isHidden;
+};
+
+// 複数の Entity のプロパティをまとめて補間する
+// duration が 0 のときは補間せずにすぐ書き込む
+struct TweenParam
+{
+	using StateType = TweenState;
+	static TweenParam FromTOML(const TOMLValue& param);
+
+	struct Target
+	{
+		Symbol entityName;
+		TweenProperty property;
+		double to;
+	};
+
+	Array<Target> targets;
+	double duration;
+	Easing easing;
+	bool isWaiting; // true: 全て終わるまで次へ進まない
+};
+
+// 持っている間は、シナリオの版（scenario.toml）やファイル（scenarios/）を捨てさせない
+// State がシナリオ内のパラメータを参照している間持つ（中身は見ない）
+using ScenarioPin = std::shared_ptr<const void>;
+
+// シナリオ内のパラメータと、それを生かしておく pin
+template<class Param>
+struct PinnedParam
+{
+	const Param& param;
+	ScenarioPin pin;
+};
+
+// シナリオ名ごとの置き場所（ScenarioLibrary が持ち、アドレスは変わらない）
+// ホットリロードでは scenario だけを新しい版に差し替える
+struct ScenarioSlot
+{
+	String name;
+	Symbol symbol; // name を番号にしたもの（置き場所が消えた後も名前を引ける）
+	String fileName; // "ファイル名/シナリオ名" のファイル名（空: scenario.toml）
+	const CompiledScenario* scenario = nullptr; // ファイルを読み込んでいないときは nullptr
+	std::shared_ptr<const CompiledScenario> version; // scenario.toml の今の版（scenarios/ のものはファイルが持つので nullptr）
+	uint64 sourceHash = 0; // 今の版の CompiledScenario::sourceHash（0: 不明）
+};
+
+struct ScenarioParam
+{
+	using StateType = ScenarioState;
+	static ScenarioParam FromTOML(const TOMLValue& param);
+
+	Symbol scenarioName;
+	const ScenarioSlot* slot = nullptr; // 全てのシナリオを変換した後に解決する
+};
+
+struct AdventureParam;
+struct ParallelParam;
+
+using StateParam = std::variant<WaitParam, SpeakParam, WalkParam, AnimParam, AdventureParam, ScenarioParam, ParallelParam, TweenParam>;
+
+struct AdventureParam
+{
+	using StateType = AdventureState;
+	static AdventureParam FromTOML(const TOMLValue& param);
+
+	Symbol entityName; // 操作するEntity名
+	Array<std::pair<Symbol, StateParam>> link; // Entity名とシナリオ（ScenarioParam）を紐づける
+};
+
+struct ParallelParam
+{
+	using StateType = ParallelState;
+	static ParallelParam FromTOML(const TOMLValue& param);
+
+	Array<StateParam> tracks; // 同時に進めるシナリオ（ScenarioParam）
+};
+
+// make で作るEntity
+struct EntityDesc
+{
+	struct Image
+	{
+		String path;
+		Size imageSize;
+		Point imagePos;
+		bool isHidden;
+	};
+
+	struct Text
+	{
+		String text;
+		int32 fontSize;
+	};
+
+	Symbol name;
+	Optional<PosComponent> pos;
+	Optional<Image> image;
+	Optional<Text> text;
+	std::shared_ptr<const AnimationClip> animation; // 無い場合は nullptr（作った Entity 同士で共有する）
+};
+
+// シナリオの1ステップ
+struct ScenarioCommand
+{
+	enum class Type
+	{
+		MAKE,
+		PUSH,
+		RESET, // clear + push
+	};
+
+	Type type;
+	Array<EntityDesc> entities; // MAKE のとき
+	StateParam param; // PUSH, RESET のとき
+};
+
+// [[Name]] 1つ分
+struct CompiledScenario
+{
+	String name;
+	Array<ScenarioCommand> commands;
+	uint64 sourceHash = 0; // 変換元の [[Name]] の値のハッシュ（0: TOML から変換していない）
+};
+
+WaitParam WaitParam::FromTOML(const TOMLValue& param)
+{
+	return { param.get<double>() };
+}
+
+SpeakParam SpeakParam::FromTOML(const TOMLValue& param)
+{
+	const Symbol entityName = GetSymbolTable().intern(param[U"entity"].getString());
+	return {
+		entityName,
+		param[U"text"].getString(),
+		Vec2{
+			param[U"offset.x"].getOr<double>(0.0),
+			param[U"offset.y"].getOr<double>(0.0)
+		},
+		SpeakEntityName(entityName),
+	};
+}
+
+WalkParam WalkParam::FromTOML(const TOMLValue& param)
+{
+	return {
+		GetSymbolTable().intern(param[U"entity"].getString()),
+		param[U"to"].get<double>(),
+		param[U"speed"].get<double>(),
+	};
+}
+
+AnimParam AnimParam::FromTOML(const TOMLValue& param)
+{
+	return {
+		GetSymbolTable().intern(param[U"entity"].getString()),
+		Point{
+			param[U"imagePos.x"].get<int32>(),
+			param[U"imagePos.y"].get<int32>()
+		},
+		param[U"isHidden"].getOr<bool>(false),
+	};
+}
+
+// {duration=1.0, easing="inout", wait=true, targets=[{entity="npc", x=450, alpha=0.5}, ...]}
+// 対象が1つのときは targets を省略して {entity="npc", x=1000} と書ける（duration の既定は 0）
+TweenParam TweenParam::FromTOML(const TOMLValue& param)
+{
+	static const HashTable<String, Easing> EASING_TABLE = {
+		{ U"linear", Easing::LINEAR },
+		{ U"in", Easing::EASE_IN },
+		{ U"out", Easing::EASE_OUT },
+		{ U"inout", Easing::EASE_IN_OUT },
+	};
+
+	static constexpr std::array<std::pair<StringView, TweenProperty>, TweenPropertyCount> PROPERTY_KEYS{ {
+		{ U"x", TweenProperty::X },
+		{ U"y", TweenProperty::Y },
+		{ U"z", TweenProperty::Z },
+		{ U"alpha", TweenProperty::ALPHA },
+		{ U"scale", TweenProperty::SCALE },
+	} };
+
+	TweenParam result{
+		{},
+		param[U"duration"].getOr<double>(0.0),
+		EASING_TABLE.at(param[U"easing"].getOr<String>(U"linear")),
+		param[U"wait"].getOr<bool>(true),
+	};
+
+	const auto addTargets = [&](const TOMLValue& target) {
+		const Symbol entityName = GetSymbolTable().intern(target[U"entity"].getString());
+		for (const auto& [key, property] : PROPERTY_KEYS)
+		{
+			if (const auto to = target[key].getOpt<double>())
+			{
+				result.targets.push_back({ entityName, property, *to });
+			}
+		}
+	};
+
+	if (param[U"targets"].isArray())
+	{
+		for (const auto& target : param[U"targets"].arrayView())
+		{
+			addTargets(target);
+		}
+	}
+	else
+	{
+		addTargets(param);
+	}
+	return result;
+}
+
+ScenarioParam ScenarioParam::FromTOML(const TOMLValue& param)
+{
+	return { GetSymbolTable().intern(param.getString()) };
+}
+
+AdventureParam AdventureParam::FromTOML(const TOMLValue& param)
+{
+	// LinkComponentのようなものをEntityに持たせる方が付け外しが容易
+	// 今回はStateに持たせて楽に済ませる
+	AdventureParam result{ GetSymbolTable().intern(param[U"entity"].getString()), {} };
+	for (const auto& [name, value] : param[U"link"].tableView())
+	{
+		result.link.emplace_back(GetSymbolTable().intern(name), ScenarioParam{ GetSymbolTable().intern(value.getString()) });
+	}
+	return result;
+}
+
+ParallelParam ParallelParam::FromTOML(const TOMLValue& param)
+{
+	ParallelParam result;
+	for (const auto& value : param.arrayView())
+	{
+		result.tracks.push_back(ScenarioParam{ GetSymbolTable().intern(value.getString()) });
+	}
+	return result;
+}
+
+// scenarios/ 以下のファイル1つ分のシナリオ
+struct ScenarioFile
+{
+	String name; // ファイル名（拡張子なし）
+	Array<std::unique_ptr<CompiledScenario>> scenarios;
+	Array<ScenarioSlot*> slots; // 追い出すときに空にする
+	size_t byteSize = 0; // メモリ使用量の目安（ファイルの大きさ）
+	uint64 lastUse = 0;
+	bool isStale = false; // 読み込んだ後にファイルが書き換えられた
+};
+
+// 全てのシナリオ
+class ScenarioLibrary
+{
+public:
+	explicit ScenarioLibrary(const TOMLValue& toml);
+
+	// 変換済みのシナリオから作る（シナリオ名の解決だけ行う）
+	explicit ScenarioLibrary(HashTable<String, CompiledScenario>&& scenarios);
+
+	// TOMLから変換する
+	static HashTable<String, CompiledScenario> Compile(const TOMLValue& toml);
+
+	// 無い場合は例外
+	const CompiledScenario& at(const String& name) const { return *m_slots.at(name)->scenario; }
+	const ScenarioSlot& slot(const String& name) const { return *m_slots.at(name); }
+
+	const HashTable<String, std::unique_ptr<ScenarioSlot>>& slots() const { return m_slots; }
+
+	// "ファイル名/シナリオ名" は scenarios/ファイル名.toml の [[シナリオ名]]
+	// 最初に push されたときにファイルごと読み込み、使われていないものは古い順に追い出す
+	static constexpr StringView ScenarioDirectory = U"scenarios/";
+	static constexpr size_t DefaultFileBudgetBytes = 4 * 1024 * 1024; // 読み込んだままにするファイルの大きさの合計
+
+	// 読み込んだままにするファイルの大きさの合計（0: 無制限）
+	void setFileBudget(size_t bytes)
+	{
+		m_fileBudgetBytes = bytes;
+		trimFiles();
+	}
+
+	struct Acquired
+	{
+		const CompiledScenario& scenario;
+		ScenarioPin pin; // 持っている間は版・ファイルを捨てない
+	};
+
+	// 名前から置き場所を探す
+	// "ファイル名/" 付きの名前はファイルを読まずに空の置き場所を作る（それ以外で無い場合は例外）
+	ScenarioSlot& resolve(const String& name);
+
+	// シナリオを取り出す（ファイルを読み込んでいなければ読み込む）
+	Acquired acquire(const ScenarioSlot& slot);
+
+	// scenarios/ のファイルが書き換えられたときに呼ぶ（使い終わり次第追い出して次の push で読み直す）
+	void invalidateFile(const String& fileName);
+
+	// param が入っているシナリオ名とコマンドの番号（セーブデータ用、無い場合は例外）
+	template<class Param>
+	std::pair<String, uint32> locate(const Param& param) const;
+
+	// name の今の版の commands[index] のパラメータとその pin（種類が違う場合は例外）
+	template<class Param>
+	PinnedParam<Param> paramAt(const String& name, uint32 index);
+
+	// 値のハッシュ（HashSource）の変わった [[Name]] だけ変換し直して差し替え、差し替えた数を返す
+	// 実行中の ScenarioState は古い版のまま最後まで進み、次に push されるものから新しい版になる
+	// 誰も pin を持っていない古い版はここで捨てる
+	// 変換に失敗したときは例外（何も差し替えない）
+	size_t reload(const TOMLValue& toml);
+
+	// 変換したシナリオのメモリ量の目安（コマンドと make の配列のみ、文字列・画像は含まない）
+	static size_t EstimateBytes(const CompiledScenario& scenario);
+
+	// f(名前, バイト数, isFile): メモリ量の目安
+	// scenario.toml のシナリオは古い版も含めて1つずつ、scenarios/ のファイルはファイルの大きさ
+	template<class F>
+	void forEachMemoryUse(F&& f) const
+	{
+		for (const auto& version : m_versions) { f(version->name, EstimateBytes(*version), false); }
+		for (const auto& [name, file] : m_files) { f(name, file->byteSize, true); }
+	}
+
+private:
+	// 読み込んだ TOML の値のハッシュ（書き方・空白・コメントの違いは無視する）
+	// テーブルのキーは並び順に依存する（TOML の中でキーを並べ替えると変更とみなす）
+	// 日付・時刻の値は見ない（シナリオでは使わない）
+	static uint64 HashSource(const TOMLValue& value);
+
+	static CompiledScenario CompileScenario(const String& name, const TOMLValue& scenario);
+	static ScenarioCommand CompileCommand(const TOMLValue& step);
+	static StateParam CompileStateParam(const String& stateName, const TOMLValue& param);
+	static Array<EntityDesc> CompileMake(const TOMLValue& params);
+
+	// param に含まれる ScenarioParam 全てに f を呼ぶ
+	template<class F>
+	static void ForEachScenarioParam(StateParam& param, F&& f);
+
+	// ScenarioParam のシナリオ名を解決する
+	void link(StateParam& param);
+
+	ScenarioSlot& addSlot(const String& name);
+
+	std::shared_ptr<ScenarioFile> loadFile(const String& fileName);
+
+	// 予算を超えている間、使われていないファイルを古い順に追い出す
+	void trimFiles();
+
+	// HashTable の要素は再配置で動くので、ScenarioParam から指す置き場所は別に確保する
+	HashTable<String, std::unique_ptr<ScenarioSlot>> m_slots;
+
+	// scenario.toml の版（古い版は State が pin を持っている間だけ残す）
+	Array<std::shared_ptr<CompiledScenario>> m_versions;
+
+	// 置き場所からも State からも参照されていない古い版を捨てる
+	void releaseUnusedVersions();
+
+	// 読み込んでいる scenarios/ のファイル
+	HashTable<String, std::shared_ptr<ScenarioFile>> m_files;
+	size_t m_fileBytes = 0;
+	size_t m_fileBudgetBytes = DefaultFileBudgetBytes;
+	uint64 m_useClock = 0; // acquire のたびに進める
+};
+
+template<class Param>
+std::pair<String, uint32> ScenarioLibrary::locate(const Param& param) const
+{
+	const auto find = [&](const CompiledScenario& scenario) -> Optional<uint32> {
+		for (size_t i = 0; i < scenario.commands.size(); ++i)
+		{
+			if (std::get_if<Param>(&scenario.commands[i].param) == &param) { return static_cast<uint32>(i); }
+		}
+		return none;
+	};
+
+	// ホットリロードで古くなった版も探す（読み込むときは今の版の同じ番号になる）
+	for (const auto& version : m_versions)
+	{
+		if (const auto index = find(*version)) { return { version->name, *index }; }
+	}
+	for (const auto& [fileName, file] : m_files)
+	{
+		for (const auto& scenario : file->scenarios)
+		{
+			if (const auto index = find(*scenario)) { return { scenario->name, *index }; }
+		}
+	}
+	throw std::runtime_error{ "ScenarioLibrary: param is not in any scenario" };
+}
+
+template<class Param>
+PinnedParam<Param> ScenarioLibrary::paramAt(const String& name, uint32 index)
+{
+	auto acquired = acquire(resolve(name));
+	if (acquired.scenario.commands.size() <= index)
+	{
+		throw std::runtime_error{ "ScenarioLibrary: bad command index: " + name.toUTF8() };
+	}
+	if (const auto* param = std::get_if<Param>(&acquired.scenario.commands[index].param))
+	{
+		return { *param, std::move(acquired.pin) };
+	}
+	throw std::runtime_error{ "ScenarioLibrary: unexpected param type: " + name.toUTF8() };
+}
+
+ScenarioLibrary::ScenarioLibrary(const TOMLValue& toml)
+	: ScenarioLibrary{ Compile(toml) }
+{
+}
+
+ScenarioLibrary::ScenarioLibrary(HashTable<String, CompiledScenario>&& scenarios)
+{
+	for (auto& [name, scenario] : scenarios)
+	{
+		m_versions.push_back(std::make_shared<CompiledScenario>(std::move(scenario)));
+
+		auto& slot = addSlot(name);
+		slot.scenario = m_versions.back().get();
+		slot.version = m_versions.back();
+		slot.sourceHash = m_versions.back()->sourceHash;
+	}
+
+	for (auto& version : m_versions)
+	{
+		for (auto& command : version->commands)
+		{
+			link(command.param);
+		}
+	}
+}
+
+HashTable<String, CompiledScenario> ScenarioLibrary::Compile(const TOMLValue& toml)
+{
+	HashTable<String, CompiledScenario> scenarios;
+	for (const auto& [name, scenario] : toml.tableView())
+	{
+		if (not scenario.isTableArray()) { continue; }
+
+		scenarios.emplace(name, CompileScenario(name, scenario));
+	}
+	return scenarios;
+}
+
+size_t ScenarioLibrary::reload(const TOMLValue& toml)
+{
+	// 変わったものだけ変換する
+	Array<std::pair<String, std::unique_ptr<CompiledScenario>>> changed;
+	for (const auto& [name, scenario] : toml.tableView())
+	{
+		if (not scenario.isTableArray()) { continue; }
+
+		if (const auto it = m_slots.find(name);
+			it != m_slots.end() && it->second->sourceHash != 0
+			&& it->second->sourceHash == HashSource(scenario))
+		{
+			continue;
+		}
+
+		changed.emplace_back(name, std::make_unique<CompiledScenario>(CompileScenario(name, scenario)));
+	}
+
+	// 失敗したときに消せるよう、今ある置き場所を覚えておく
+	// （link の resolve も "ファイル名/シナリオ名" の置き場所を作る）
+	HashSet<String> oldNames;
+	for (const auto& [name, slot] : m_slots)
+	{
+		oldNames.insert(name);
+	}
+
+	// 新しく増えたシナリオの置き場所を先に作ってから名前を解決する
+	for (const auto& [name, compiled] : changed)
+	{
+		if (not m_slots.contains(name))
+		{
+			addSlot(name);
+		}
+	}
+
+	try
+	{
+		for (auto& [name, compiled] : changed)
+		{
+			for (auto& command : compiled->commands)
+			{
+				link(command.param);
+			}
+		}
+	}
+	catch (...)
+	{
+		Array<String> addedNames;
+		for (const auto& [name, slot] : m_slots)
+		{
+			if (not oldNames.contains(name)) { addedNames.push_back(name); }
+		}
+		for (const auto& name : addedNames)
+		{
+			m_slots.erase(name);
+		}
+		throw;
+	}
+
+	// 差し替え（消えた [[Name]] は参照が残っているかもしれないので古い版のまま残す）
+	for (auto& [name, compiled] : changed)
+	{
+		auto& slot = *m_slots.at(name);
+		m_versions.push_back(std::move(compiled));
+		slot.scenario = m_versions.back().get();
+		slot.version = m_versions.back();
+		slot.sourceHash = m_versions.back()->sourceHash;
+	}
+
+	releaseUnusedVersions();
+	return changed.size();
+}
+
+void ScenarioLibrary::releaseUnusedVersions()
+{
+	// m_versions だけが持っているもの（置き場所の今の版は slot.version も持っている）
+	m_versions.remove_if([](const std::shared_ptr<CompiledScenario>& version) { return version.use_count() == 1; });
+}
+
+CompiledScenario ScenarioLibrary::CompileScenario(const String& name, const TOMLValue& scenario)
+{
+	CompiledScenario compiled{ name, {}, HashSource(scenario) };
+	for (const auto& step : scenario.tableArrayView())
+	{
+		if (step[U"make"].isTableArray() || step[U"push"].isString() || step[U"reset"].isString())
+		{
+			compiled.commands.push_back(CompileCommand(step));
+		}
+	}
+	return compiled;
+}
+
+ScenarioCommand ScenarioLibrary::CompileCommand(const TOMLValue& step)
+{
+	if (step[U"make"].isTableArray())
+	{
+		return { ScenarioCommand::Type::MAKE, CompileMake(step[U"make"]), WaitParam{} };
+	}
+
+	if (step[U"push"].isString())
+	{
+		return { ScenarioCommand::Type::PUSH, {}, CompileStateParam(step[U"push"].getString(), step[U"param"]) };
+	}
+
+	return { ScenarioCommand::Type::RESET, {}, CompileStateParam(step[U"reset"].getString(), step[U"param"]) };
+}
+
+StateParam ScenarioLibrary::CompileStateParam(const String& stateName, const TOMLValue& param)
+{
+	using CompileFunc = StateParam(*)(const TOMLValue&);
+
+	static const HashTable<String, CompileFunc> COMPILE_TABLE = {
+		{ U"wait", [](const TOMLValue& p) -> StateParam { return WaitParam::FromTOML(p); } },
+		{ U"speak", [](const TOMLValue& p) -> StateParam { return SpeakParam::FromTOML(p); } },
+		{ U"walk", [](const TOMLValue& p) -> StateParam { return WalkParam::FromTOML(p); } },
+		{ U"anim", [](const TOMLValue& p) -> StateParam { return AnimParam::FromTOML(p); } },
+		{ U"adventure", [](const TOMLValue& p) -> StateParam { return AdventureParam::FromTOML(p); } },
+		{ U"scenario", [](const TOMLValue& p) -> StateParam { return ScenarioParam::FromTOML(p); } },
+		{ U"parallel", [](const TOMLValue& p) -> StateParam { return ParallelParam::FromTOML(p); } },
+		{ U"tween", [](const TOMLValue& p) -> StateParam { return TweenParam::FromTOML(p); } },
+	};
+
+	return COMPILE_TABLE.at(stateName)(param);
+}
+
+Array<EntityDesc> ScenarioLibrary::CompileMake(const TOMLValue& params)
+{
+	Array<EntityDesc> result;
+	for (const auto& param : params.tableArrayView())
+	{
+		EntityDesc desc{ GetSymbolTable().intern(param[U"name"].getString()), none, none, none };
+
+		if (param[U"pos"].isTable())
+		{
+			TOMLValue pos = param[U"pos"];
+			desc.pos = PosComponent{
+				Vec3{
+					pos[U"x"].get<double>(),
+					pos[U"y"].get<double>(),
+					pos[U"z"].get<double>(),
+				}
+			};
+		}
+
+		if (param[U"image"].isTable())
+		{
+			TOMLValue image = param[U"image"];
+			desc.image = EntityDesc::Image{
+				image[U"path"].getString(),
+				Size{
+					image[U"size.x"].get<int32>(),
+					image[U"size.y"].get<int32>(),
+				},
+				Point{
+					image[U"pos.x"].get<int32>(),
+					image[U"pos.y"].get<int32>(),
+				},
+				image[U"isHidden"].getOr<bool>(false),
+			};
+		}
+
+		if (param[U"text"].isTable())
+		{
+			TOMLValue text = param[U"text"];
+			desc.text = EntityDesc::Text{
+				text[U"text"].getString(),
+				text[U"font.size"].get<int32>(),
+			};
+		}
+
+		if (param[U"animation"].isTable())
+		{
+			static const HashTable<String, AnimationClip::Loop> LOOP_TABLE = {
+				{ U"once", AnimationClip::Loop::ONCE },
+				{ U"loop", AnimationClip::Loop::LOOP },
+				{ U"pingpong", AnimationClip::Loop::PING_PONG },
+			};
+
+			TOMLValue animation = param[U"animation"];
+			AnimationClip clip{ {}, animation[U"fps"].get<double>(), LOOP_TABLE.at(animation[U"loop"].getOr<String>(U"loop")) };
+			for (const auto& frame : animation[U"frames"].arrayView())
+			{
+				clip.frames.emplace_back(frame[U"x"].get<int32>(), frame[U"y"].get<int32>());
+			}
+			if (clip.frames.isEmpty() || clip.fps <= 0.0)
+			{
+				throw std::runtime_error{ "ScenarioLibrary: animation needs frames and a positive fps" };
+			}
+			desc.animation = std::make_shared<const AnimationClip>(std::move(clip));
+		}
+
+		result.push_back(std::move(desc));
+	}
+	return result;
+}
+
+template<class F>
+void ScenarioLibrary::ForEachScenarioParam(StateParam& param, F&& f)
+{
+	if (auto* scenarioParam = std::get_if<ScenarioParam>(&param))
+	{
+		f(*scenarioParam);
+	}
+	else if (auto* adventureParam = std::get_if<AdventureParam>(&param))
+	{
+		for (auto& [entityName, target] : adventureParam->link)
+		{
+			ForEachScenarioParam(target, f);
+		}
+	}
+	else if (auto* parallelParam = std::get_if<ParallelParam>(&param))
+	{
+		for (auto& track : parallelParam->tracks)
+		{
+			ForEachScenarioParam(track, f);
+		}
+	}
+}
+
+void ScenarioLibrary::link(StateParam& param)
+{
+	ForEachScenarioParam(param, [&](ScenarioParam& scenarioParam) {
+		scenarioParam.slot = &resolve(GetSymbolTable().name(scenarioParam.scenarioName));
+	});
+}
+
+ScenarioSlot& ScenarioLibrary::addSlot(const String& name)
+{
+	auto& slot = *m_slots.emplace(name, std::make_unique<ScenarioSlot>()).first->second;
+	slot.name = name;
+	slot.symbol = GetSymbolTable().intern(name);
+	if (const size_t separator = name.indexOf(U'/'); separator != String::npos)
+	{
+		slot.fileName = name.substr(0, separator);
+	}
+	return slot;
+}
+
+ScenarioSlot& ScenarioLibrary::resolve(const String& name)
+{
+	if (auto it = m_slots.find(name); it != m_slots.end())
+	{
+		return *it->second;
+	}
+
+	if (name.indexOf(U'/') == String::npos)
+	{
+		return *m_slots.at(name); // scenario.toml に無い（例外）
+	}
+	return addSlot(name);
+}
+
+ScenarioLibrary::Acquired ScenarioLibrary::acquire(const ScenarioSlot& slot)
+{
+	if (slot.fileName.isEmpty())
+	{
+		return { *slot.scenario, slot.version };
+	}
+
+	std::shared_ptr<ScenarioFile> file;
+	if (auto it = m_files.find(slot.fileName); it != m_files.end() && not it->second->isStale)
+	{
+		file = it->second;
+	}
+	else
+	{
+		file = loadFile(slot.fileName);
+	}
+	file->lastUse = ++m_useClock;
+
+	if (not slot.scenario)
+	{
+		throw std::runtime_error{ "ScenarioLibrary: scenario not found: " + slot.name.toUTF8() };
+	}
+
+	trimFiles(); // file を持っているので今読んだファイルは追い出されない
+	return { *slot.scenario, std::move(file) };
+}
+
+void ScenarioLibrary::invalidateFile(const String& fileName)
+{
+	if (auto it = m_files.find(fileName); it != m_files.end())
+	{
+		it->second->isStale = true;
+		trimFiles();
+	}
+}
+
+std::shared_ptr<ScenarioFile> ScenarioLibrary::loadFile(const String& fileName)
+{
+	const FilePath path = FilePath{ ScenarioDirectory } + fileName + U".toml";
+	const TOMLReader toml{ path };
+	if (not toml)
+	{
+		throw std::runtime_error{ "ScenarioLibrary: failed to load " + path.toUTF8() };
+	}
+
+	auto scenarios = Compile(toml);
+
+	// ファイル内のシナリオ名には "ファイル名/" を付ける（ファイル内で参照するときは省略できる）
+	const String prefix = fileName + U"/";
+	auto file = std::make_shared<ScenarioFile>();
+	file->name = fileName;
+	file->byteSize = static_cast<size_t>(FileSystem::FileSize(path));
+	for (auto& [name, scenario] : scenarios)
+	{
+		scenario.name = prefix + name;
+		for (auto& command : scenario.commands)
+		{
+			ForEachScenarioParam(command.param, [&](ScenarioParam& scenarioParam) {
+				if (const String& targetName = GetSymbolTable().name(scenarioParam.scenarioName); scenarios.contains(targetName))
+				{
+					scenarioParam.scenarioName = GetSymbolTable().intern(prefix + targetName);
+				}
+			});
+		}
+		file->scenarios.push_back(std::make_unique<CompiledScenario>(std::move(scenario)));
+	}
+
+	for (auto& scenario : file->scenarios)
+	{
+		for (auto& command : scenario->commands)
+		{
+			link(command.param);
+		}
+	}
+
+	// 書き換えられた古い版が残っていれば、使われていても置き場所からは外す（新しく push されるものは新しい版）
+	if (auto it = m_files.find(fileName); it != m_files.end())
+	{
+		m_fileBytes -= it->second->byteSize;
+		m_files.erase(it);
+	}
+
+	for (auto& scenario : file->scenarios)
+	{
+		auto& slot = resolve(scenario->name);
+		slot.scenario = scenario.get();
+		file->slots.push_back(&slot);
+	}
+
+	m_fileBytes += file->byteSize;
+	m_files.emplace(fileName, file);
+	return file;
+}
+
+size_t ScenarioLibrary::EstimateBytes(const CompiledScenario& scenario)
+{
+	size_t bytes = sizeof(CompiledScenario) + scenario.commands.capacity() * sizeof(ScenarioCommand);
+	for (const auto& command : scenario.commands)
+	{
+		bytes += command.entities.capacity() * sizeof(EntityDesc);
+	}
+	return bytes;
+}
+
+void ScenarioLibrary::trimFiles()
+{
+	for (;;)
+	{
+		// 使われていないもののうち、書き換えられたもの、なければ予算を超えている間は最後に使ったのが古いもの
+		const ScenarioFile* victim = nullptr;
+		for (const auto& [name, file] : m_files)
+		{
+			if (file.use_count() != 1) { continue; }
+
+			if (file->isStale)
+			{
+				victim = file.get();
+				break;
+			}
+
+			if (m_fileBudgetBytes != 0 && m_fileBudgetBytes < m_fileBytes && (not victim || file->lastUse < victim->lastUse))
+			{
+				victim = file.get();
+			}
+		}
+
+		if (not victim) { return; }
+
+		for (auto* slot : victim->slots)
+		{
+			slot->scenario = nullptr;
+		}
+		m_fileBytes -= victim->byteSize;
+		const String name = victim->name;
+		m_files.erase(name);
+	}
+}
+
+/*
+* ScenarioBinary
+*/
+
+// 変換済みのシナリオを書き出したファイル
+// [ヘッダ][文字列テーブル][シナリオ...] の順に並べる
+// 文字列はテーブルの番号で参照する
+namespace ScenarioBinary
+{
+	constexpr uint32 Magic = 0x4E424353; // "SCBN"
+	constexpr uint32 Version = 5;
+
+	struct Header
+	{
+		uint32 magic;
+		uint32 version;
+		uint64 sourceHash; // 変換元の scenario.toml のハッシュ
+		uint32 stringCount;
+		uint32 scenarioCount;
+	};
+
+	// FNV-1a（hash に前回の結果を渡すと続けてハッシュする）
+	inline uint64 HashBytes(const void* data, size_t size, uint64 hash = 14695981039346656037ULL)
+	{
+		const auto* p = static_cast<const uint8*>(data);
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash = (hash ^ p[i]) * 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	// ファイルが無い場合は 0
+	inline uint64 HashFile(FilePathView path)
+	{
+		const Blob blob{ path };
+		return blob.isEmpty() ? 0 : HashBytes(blob.data(), blob.size());
+	}
+
+	// 書き出し
+	class Encoder
+	{
+	public:
+		template<class Type>
+		void write(const Type& value)
+		{
+			static_assert(std::is_trivially_copyable_v<Type>);
+			const auto* p = reinterpret_cast<const uint8*>(&value);
+			m_bytes.insert(m_bytes.end(), p, p + sizeof(Type));
+		}
+
+		// 要素数の後に中身をまとめて書く
+		template<class Type>
+		void writeArray(const Array<Type>& values)
+		{
+			static_assert(std::is_trivially_copyable_v<Type>);
+			write<uint32>(static_cast<uint32>(values.size()));
+			const auto* p = reinterpret_cast<const uint8*>(values.data());
+			m_bytes.insert(m_bytes.end(), p, p + values.size_bytes());
+		}
+
+		void writeString(const String& str)
+		{
+			auto [it, inserted] = m_stringIndices.emplace(str, static_cast<uint32>(m_strings.size()));
+			if (inserted) { m_strings.push_back(str); }
+			write<uint32>(it->second);
+		}
+
+		// Symbol の番号は起動ごとに変わるので名前で書く
+		void writeString(Symbol symbol)
+		{
+			writeString(GetSymbolTable().name(symbol));
+		}
+
+		void writeParam(const StateParam& param);
+		void writeEntities(const Array<EntityDesc>& descs);
+		void writeClip(const AnimationClip& clip);
+
+		// magic, version: 同じ形式で別の種類のファイルを書くとき（SaveData）
+		bool save(FilePathView path, uint64 sourceHash, uint32 scenarioCount, uint32 magic = Magic, uint32 version = Version) const;
+
+	private:
+		Array<uint8> m_bytes;
+		Array<String> m_strings;
+		HashTable<String, uint32> m_stringIndices;
+	};
+
+	inline void Encoder::writeParam(const StateParam& param)
+	{
+		write<uint8>(static_cast<uint8>(param.index()));
+		std::visit([this](const auto& p) {
+			using ParamType = std::decay_t<decltype(p)>;
+			if constexpr (std::is_same_v<ParamType, WaitParam>)
+			{
+				write(p.seconds);
+			}
+			else if constexpr (std::is_same_v<ParamType, SpeakParam>)
+			{
+				writeString(p.entityName);
+				writeString(p.text);
+				write(p.offset.x);
+				write(p.offset.y);
+			}
+			else if constexpr (std::is_same_v<ParamType, WalkParam>)
+			{
+				writeString(p.entityName);
+				write(p.to);
+				write(p.speed);
+			}
+			else if constexpr (std::is_same_v<ParamType, AnimParam>)
+			{
+				writeString(p.entityName);
+				write(p.imagePos.x);
+				write(p.imagePos.y);
+				write<uint8>(p.isHidden);
+			}
+			else if constexpr (std::is_same_v<ParamType, AdventureParam>)
+			{
+				writeString(p.entityName);
+				write<uint32>(static_cast<uint32>(p.link.size()));
+				for (const auto& [entityName, target] : p.link)
+				{
+					writeString(entityName);
+					writeString(std::get<ScenarioParam>(target).scenarioName);
+				}
+			}
+			else if constexpr (std::is_same_v<ParamType, ScenarioParam>)
+			{
+				writeString(p.scenarioName);
+			}
+			else if constexpr (std::is_same_v<ParamType, ParallelParam>)
+			{
+				write<uint32>(static_cast<uint32>(p.tracks.size()));
+				for (const auto& track : p.tracks)
+				{
+					writeString(std::get<ScenarioParam>(track).scenarioName);
+				}
+			}
+			else if constexpr (std::is_same_v<ParamType, TweenParam>)
+			{
+				write<uint32>(static_cast<uint32>(p.targets.size()));
+				for (const auto& target : p.targets)
+				{
+					writeString(target.entityName);
+					write<uint8>(static_cast<uint8>(target.property));
+					write(target.to);
+				}
+				write(p.duration);
+				write<uint8>(static_cast<uint8>(p.easing));
+				write<uint8>(p.isWaiting);
+			}
+		}, param);
+	}
+
+	inline void Encoder::writeEntities(const Array<EntityDesc>& descs)
+	{
+		write<uint32>(static_cast<uint32>(descs.size()));
+		for (const auto& desc : descs)
+		{
+			writeString(desc.name);
+			write<uint8>(desc.pos.has_value() | (desc.image.has_value() << 1) | (desc.text.has_value() << 2) | ((desc.animation != nullptr) << 3));
+			if (desc.pos)
+			{
+				write(desc.pos->pos.x);
+				write(desc.pos->pos.y);
+				write(desc.pos->pos.z);
+			}
+			if (desc.image)
+			{
+				writeString(desc.image->path);
+				write(desc.image->imageSize.x);
+				write(desc.image->imageSize.y);
+				write(desc.image->imagePos.x);
+				write(desc.image->imagePos.y);
+				write<uint8>(desc.image->isHidden);
+			}
+			if (desc.text)
+			{
+				writeString(desc.text->text);
+				write(desc.text->fontSize);
+			}
+			if (desc.animation)
+			{
+				writeClip(*desc.animation);
+			}
+		}
+	}
+
+	inline void Encoder::writeClip(const AnimationClip& clip)
+	{
+		write<uint32>(static_cast<uint32>(clip.frames.size()));
+		for (const auto& frame : clip.frames)
+		{
+			write(frame.x);
+			write(frame.y);
+		}
+		write(clip.fps);
+		write<uint8>(static_cast<uint8>(clip.loop));
+	}
+
+	inline bool Encoder::save(FilePathView path, uint64 sourceHash, uint32 scenarioCount, uint32 magic, uint32 version) const
+	{
+		BinaryWriter writer{ path };
+		if (not writer) { return false; }
+
+		const Header header{ magic, version, sourceHash, static_cast<uint32>(m_strings.size()), scenarioCount };
+		writer.write(header);
+
+		// 文字列テーブル：長さの配列の後に UTF-32 の文字を並べる
+		for (const auto& str : m_strings)
+		{
+			writer.write(static_cast<uint32>(str.size()));
+		}
+		for (const auto& str : m_strings)
+		{
+			writer.write(str.data(), str.size_bytes());
+		}
+
+		writer.write(m_bytes.data(), m_bytes.size());
+		return true;
+	}
+
+	// 全てのシナリオを書き出す
+	inline bool Save(const HashTable<String, CompiledScenario>& scenarios, FilePathView path, uint64 sourceHash)
+	{
+		Encoder encoder;
+		for (const auto& [name, scenario] : scenarios)
+		{
+			encoder.writeString(name);
+			encoder.write<uint64>(scenario.sourceHash);
+			encoder.write<uint32>(static_cast<uint32>(scenario.commands.size()));
+			for (const auto& command : scenario.commands)
+			{
+				encoder.write<uint8>(static_cast<uint8>(command.type));
+				if (command.type == ScenarioCommand::Type::MAKE)
+				{
+					encoder.writeEntities(command.entities);
+				}
+				else
+				{
+					encoder.writeParam(command.param);
+				}
+			}
+		}
+		return encoder.save(path, sourceHash, static_cast<uint32>(scenarios.size()));
+	}
+
+	// 読み込み（メモリマップしたファイルを先頭から読む）
+	// 文字列テーブルはマップしたメモリを直接参照する
+	class Decoder
+	{
+	public:
+		Decoder(const Byte* data, size_t size)
+			: m_p{ reinterpret_cast<const uint8*>(data) }
+			, m_end{ m_p + size } {}
+
+		template<class Type>
+		Type read()
+		{
+			static_assert(std::is_trivially_copyable_v<Type>);
+			if (remaining() < sizeof(Type)) { throw std::runtime_error{ "ScenarioBinary: unexpected end of file" }; }
+			Type value;
+			std::memcpy(&value, m_p, sizeof(Type));
+			m_p += sizeof(Type);
+			return value;
+		}
+
+		// 要素数を読む（1要素が少なくとも minBytes バイトあるとして、残りに収まらない数は例外）
+		// 壊れたファイルの要素数で大きな配列を確保しないように、確保する前に呼ぶ
+		uint32 readCount(size_t minBytes)
+		{
+			const uint32 count = read<uint32>();
+			if (remaining() / minBytes < count) { throw std::runtime_error{ "ScenarioBinary: unexpected end of file" }; }
+			return count;
+		}
+
+		template<class Type>
+		Array<Type> readArray()
+		{
+			static_assert(std::is_trivially_copyable_v<Type>);
+			Array<Type> values(readCount(sizeof(Type)));
+			if (values.isEmpty()) { return values; }
+			std::memcpy(values.data(), m_p, values.size_bytes());
+			m_p += values.size_bytes();
+			return values;
+		}
+
+		void readStringTable(uint32 count);
+
+		StringView readString()
+		{
+			const uint32 index = read<uint32>();
+			if (m_strings.size() <= index) { throw std::runtime_error{ "ScenarioBinary: bad string index" }; }
+			return m_strings[index];
+		}
+
+		Symbol readSymbol()
+		{
+			return GetSymbolTable().intern(readString());
+		}
+
+		StateParam readParam();
+		Array<EntityDesc> readEntities();
+		std::shared_ptr<const AnimationClip> readClip();
+
+	private:
+		size_t remaining() const { return static_cast<size_t>(m_end - m_p); }
+
+		const uint8* m_p;
+		const uint8* m_end;
+		Array<StringView> m_strings;
+	};
+
+	inline void Decoder::readStringTable(uint32 count)
+	{
+		if (remaining() / sizeof(uint32) < count) { throw std::runtime_error{ "ScenarioBinary: unexpected end of file" }; }
+		Array<uint32> lengths(count);
+		for (auto& length : lengths)
+		{
+			length = read<uint32>();
+		}
+		m_strings.reserve(count);
+		for (const auto& length : lengths)
+		{
+			if (remaining() / sizeof(char32) < length) { throw std::runtime_error{ "ScenarioBinary: unexpected end of file" }; }
+			const size_t bytes = length * sizeof(char32);
+			m_strings.emplace_back(reinterpret_cast<const char32*>(m_p), length); // ヘッダと長さが4バイト単位なので揃っている
+			m_p += bytes;
+		}
+	}
+
+	inline StateParam Decoder::readParam()
+	{
+		switch (read<uint8>())
+		{
+		case 0:
+			return WaitParam{ read<double>() };
+		case 1:
+		{
+			SpeakParam p;
+			p.entityName = readSymbol();
+			p.speakEntityName = SpeakParam::SpeakEntityName(p.entityName);
+			p.text = String{ readString() };
+			p.offset.x = read<double>();
+			p.offset.y = read<double>();
+			return p;
+		}
+		case 2:
+		{
+			WalkParam p;
+			p.entityName = readSymbol();
+			p.to = read<double>();
+			p.speed = read<double>();
+			return p;
+		}
+		case 3:
+		{
+			AnimParam p;
+			p.entityName = readSymbol();
+			p.imagePos.x = read<int32>();
+			p.imagePos.y = read<int32>();
+			p.isHidden = read<uint8>();
+			return p;
+		}
+		case 4:
+		{
+			AdventureParam p;
+			p.entityName = readSymbol();
+			const uint32 count = read<uint32>();
+			for (uint32 i = 0; i < count; ++i)
+			{
+				const Symbol entityName = readSymbol();
+				const Symbol scenarioName = readSymbol();
+				p.link.emplace_back(entityName, ScenarioParam{ scenarioName });
+			}
+			return p;
+		}
+		case 5:
+			return ScenarioParam{ readSymbol() };
+		case 6:
+		{
+			ParallelParam p;
+			const uint32 count = read<uint32>();
+			for (uint32 i = 0; i < count; ++i)
+			{
+				p.tracks.push_back(ScenarioParam{ readSymbol() });
+			}
+			return p;
+		}
+		case 7:
+		{
+			TweenParam p;
+			p.targets.resize(readCount(sizeof(uint32) + sizeof(uint8) + sizeof(double)));
+			for (auto& target : p.targets)
+			{
+				target.entityName = readSymbol();
+				target.property = static_cast<TweenProperty>(read<uint8>());
+				target.to = read<double>();
+				if (TweenPropertyCount <= static_cast<size_t>(target.property)) { throw std::runtime_error{ "ScenarioBinary: bad tween" }; }
+			}
+			p.duration = read<double>();
+			p.easing = static_cast<Easing>(read<uint8>());
+			p.isWaiting = read<uint8>();
+			if (Easing::EASE_IN_OUT < p.easing) { throw std::runtime_error{ "ScenarioBinary: bad tween" }; }
+			return p;
+		}
+		}
+		throw std::runtime_error{ "ScenarioBinary: bad state type" };
+	}
+
+	inline Array<EntityDesc> Decoder::readEntities()
+	{
+		Array<EntityDesc> descs(readCount(sizeof(uint32) + sizeof(uint8))); // 名前とフラグ
+		for (auto& desc : descs)
+		{
+			desc.name = readSymbol();
+			const uint8 flags = read<uint8>();
+			if (flags & 1)
+			{
+				const double x = read<double>();
+				const double y = read<double>();
+				const double z = read<double>();
+				desc.pos = PosComponent{ Vec3{ x, y, z } };
+			}
+			if (flags & 2)
+			{
+				EntityDesc::Image image;
+				image.path = String{ readString() };
+				image.imageSize.x = read<int32>();
+				image.imageSize.y = read<int32>();
+				image.imagePos.x = read<int32>();
+				image.imagePos.y = read<int32>();
+				image.isHidden = read<uint8>();
+				desc.image = std::move(image);
+			}
+			if (flags & 4)
+			{
+				EntityDesc::Text text;
+				text.text = String{ readString() };
+				text.fontSize = read<int32>();
+				desc.text = std::move(text);
+			}
+			if (flags & 8)
+			{
+				desc.animation = readClip();
+			}
+		}
+		return descs;
+	}
+
+	inline std::shared_ptr<const AnimationClip> Decoder::readClip()
+	{
+		AnimationClip clip{ Array<Point>(readCount(sizeof(int32) * 2)), 0.0, AnimationClip::Loop::LOOP };
+		for (auto& frame : clip.frames)
+		{
+			frame.x = read<int32>();
+			frame.y = read<int32>();
+		}
+		clip.fps = read<double>();
+		clip.loop = static_cast<AnimationClip::Loop>(read<uint8>());
+		if (clip.frames.isEmpty() || (not (0.0 < clip.fps)) || AnimationClip::Loop::PING_PONG < clip.loop)
+		{
+			throw std::runtime_error{ "ScenarioBinary: bad animation" };
+		}
+		return std::make_shared<const AnimationClip>(std::move(clip));
+	}
+
+	// 変換元のハッシュが一致しない・壊れている場合は none
+	inline Optional<HashTable<String, CompiledScenario>> Load(FilePathView path, uint64 sourceHash)
+	{
+		if (not FileSystem::IsFile(path)) { return none; }
+
+		MemoryMappedFileView file{ path };
+		if (not file) { return none; }
+		const auto mapped = file.mapAll();
+
+		try
+		{
+			Decoder decoder{ mapped.data, mapped.size };
+			const auto header = decoder.read<Header>();
+			if (header.magic != Magic || header.version != Version
+				|| (sourceHash != 0 && header.sourceHash != sourceHash)) // 変換元が無い場合はそのまま使う
+			{
+				return none;
+			}
+			decoder.readStringTable(header.stringCount);
+
+			HashTable<String, CompiledScenario> scenarios;
+			for (uint32 i = 0; i < header.scenarioCount; ++i)
+			{
+				CompiledScenario scenario{ String{ decoder.readString() }, {} };
+				scenario.sourceHash = decoder.read<uint64>();
+				scenario.commands.resize(decoder.readCount(sizeof(uint8)));
+				for (auto& command : scenario.commands)
+				{
+					const uint8 type = decoder.read<uint8>();
+					if (static_cast<uint8>(ScenarioCommand::Type::RESET) < type) { throw std::runtime_error{ "ScenarioBinary: bad command type" }; }
+					command.type = static_cast<ScenarioCommand::Type>(type);
+					if (command.type == ScenarioCommand::Type::MAKE)
+					{
+						command.entities = decoder.readEntities();
+					}
+					else
+					{
+						command.param = decoder.readParam();
+					}
+				}
+				const String name = scenario.name;
+				scenarios.emplace(name, std::move(scenario));
+			}
+			return scenarios;
+		}
+		catch (const std::exception&) // 壊れたファイルは runtime_error 以外（bad_alloc など）も起こしうる
+		{
+			return none;
+		}
+	}
+}
+
+uint64 ScenarioLibrary::HashSource(const TOMLValue& value)
+{
+	using ScenarioBinary::HashBytes;
+
+	// 種類ごとの印を前に付け、テーブル・配列の終わりにも印を付ける（[a, b] と [a], b などを見分ける）
+	const auto hashValue = [](const auto& self, const TOMLValue& value, uint64 hash) -> uint64 {
+		const auto hashTag = [&](uint8 tag) { hash = HashBytes(&tag, sizeof(tag), hash); };
+		const auto hashString = [&](const String& str) {
+			const uint32 length = static_cast<uint32>(str.size());
+			hash = HashBytes(&length, sizeof(length), hash);
+			hash = HashBytes(str.data(), str.size_bytes(), hash);
+		};
+
+		if (value.isTable())
+		{
+			hashTag(1);
+			for (const auto& [key, member] : value.tableView())
+			{
+				hashString(key);
+				hash = self(self, member, hash);
+			}
+			hashTag(0);
+		}
+		else if (value.isArray())
+		{
+			hashTag(2);
+			for (const auto& element : value.arrayView())
+			{
+				hash = self(self, element, hash);
+			}
+			hashTag(0);
+		}
+		else if (value.isTableArray())
+		{
+			hashTag(3);
+			for (const auto& element : value.tableArrayView())
+			{
+				hash = self(self, element, hash);
+			}
+			hashTag(0);
+		}
+		else if (value.isString())
+		{
+			hashTag(4);
+			hashString(value.getString());
+		}
+		else if (value.isNumber())
+		{
+			hashTag(5);
+			const double number = value.get<double>();
+			hash = HashBytes(&number, sizeof(number), hash);
+		}
+		else if (value.isBool())
+		{
+			hashTag(6);
+			hashTag(value.get<bool>() ? 1 : 0);
+		}
+		else
+		{
+			hashTag(7);
+		}
+		return hash;
+	};
+
+	const uint64 hash = hashValue(hashValue, value, HashBytes(nullptr, 0));
+	return (hash == 0) ? 1 : hash; // 0 は「不明」に使う
+}
+
+// 変換済みのファイルが新しければそれを、古ければ TOML を読む
+constexpr StringView ScenarioTOMLPath = U"scenario.toml";
+constexpr StringView ScenarioBinaryPath = U"scenario.bin";
+
+// ScenarioReloader だけが書き換える
+ScenarioLibrary& GetScenarioLibrary()
+{
+	static ScenarioLibrary library = [] {
+		if (auto scenarios = ScenarioBinary::Load(ScenarioBinaryPath, ScenarioBinary::HashFile(ScenarioTOMLPath)))
+		{
+			return ScenarioLibrary{ std::move(*scenarios) };
+		}
+		return ScenarioLibrary{ ScenarioLibrary::Compile(TOMLReader{ ScenarioTOMLPath }) };
+	}();
+	return library;
+}
+
+// scenario.toml を変換して scenario.bin に書き出す
+bool PackScenario()
+{
+	const auto scenarios = ScenarioLibrary::Compile(TOMLReader{ ScenarioTOMLPath });
+	return ScenarioBinary::Save(scenarios, ScenarioBinaryPath, ScenarioBinary::HashFile(ScenarioTOMLPath));
+}
+
+// シミュレーションのスレッドで起きたシナリオの読み込みの失敗（scenarios/ のファイルが無い・シナリオが無いなど）
+// ゲームは止めずに、ScenarioReloader がメインスレッドで表示する
+class ScenarioErrorLog
+{
+public:
+	void report(const String& message)
+	{
+		std::lock_guard lock{ m_mutex };
+		m_messages.push_back(message);
+	}
+
+	Array<String> take()
+	{
+		std::lock_guard lock{ m_mutex };
+		return std::exchange(m_messages, {});
+	}
+
+private:
+	std::mutex m_mutex;
+	Array<String> m_messages;
+};
+
+ScenarioErrorLog& GetScenarioErrorLog()
+{
+	static ScenarioErrorLog log;
+	return log;
+}
+
+
+/*
+* ScenarioReloader
+*/
+
+// scenario.toml の変更を監視して、変わった [[Name]] だけ変換し直す
+// scenarios/ のファイルが変わったときは、次に push されるときに読み直す
+// 画像は AssetCache に残っているものをそのまま使う
+class ScenarioReloader
+{
+public:
+	ScenarioReloader();
+
+	// 変更があれば読み直す（メインループから呼ぶ）
+	void update();
+
+private:
+	FilePath m_path; // scenario.toml のフルパス
+	DirectoryWatcher m_watcher;
+	DirectoryWatcher m_directoryWatcher; // scenarios/
+};
+
+ScenarioReloader::ScenarioReloader()
+	: m_path{ FileSystem::FullPath(ScenarioTOMLPath) }
+	, m_watcher{ FileSystem::ParentPath(m_path) }
+	, m_directoryWatcher{ ScenarioLibrary::ScenarioDirectory }
+{
+}
+
+void ScenarioReloader::update()
+{
+	for (const auto& message : GetScenarioErrorLog().take())
+	{
+		Print << message;
+	}
+
+	for (const auto& change : m_directoryWatcher.retrieveChanges())
+	{
+		if (FileSystem::Extension(change.path) == U"toml")
+		{
+			GetScenarioLibrary().invalidateFile(FileSystem::BaseName(change.path));
+		}
+	}
+
+	bool isChanged = false;
+	for (const auto& change : m_watcher.retrieveChanges())
+	{
+		// エディタによっては置き換え（Added）で保存される
+		if (change.path == m_path
+			&& (change.action == FileAction::Modified || change.action == FileAction::Added))
+		{
+			isChanged = true;
+		}
+	}
+	if (not isChanged) { return; }
+
+	// 書きかけなどで読めないときは今のシナリオのまま、次の変更を待つ
+	const TOMLReader toml{ ScenarioTOMLPath };
+	if (not toml)
+	{
+		Print << U"scenario.toml: 読み込みに失敗しました";
+		return;
+	}
+
+	try
+	{
+		const size_t count = GetScenarioLibrary().reload(toml);
+		Print << U"scenario.toml: {} 個のシナリオを更新しました"_fmt(count);
+	}
+	catch (const std::exception& e)
+	{
+		Print << U"scenario.toml: " << Unicode::Widen(e.what());
+	}
+}
+
+
+/*
+* TextureAtlas
+*/
+
+// true のとき scenario.toml で使う画像を数枚のテクスチャにまとめる
+constexpr bool UseTextureAtlas = true;
+
+// 複数の画像を大きなテクスチャ（ページ）に詰めたもの
+class TextureAtlas
+{
+public:
+	struct Region
+	{
+		Texture texture; // ページのテクスチャ
+		Point offset; // ページ内での画像の位置
+		Size size; // 画像の大きさ
+	};
+
+	static constexpr Size PageSize{ 2048, 2048 };
+	static constexpr int32 Padding = 2; // 隣の画像がにじまないように空ける
+
+	// 別スレッドで画像を読み込んでページの画像に詰め始める（テクスチャにするのは update か finish）
+	void start(const Array<String>& paths);
+
+	// 詰め終わっていればページをテクスチャにする（メインスレッドで毎フレーム、シミュレーションの止まっている間に呼ぶ）
+	void update();
+
+	// 詰め終わるまで待ってページをテクスチャにする（メインスレッドで、最初のシナリオを始める前に呼ぶ）
+	void finish();
+
+	// アトラスに含まれていない場合や、まだテクスチャにしていない場合は none
+	// テクスチャは作らないので、シミュレーションのスレッドから呼んでもよい
+	Optional<Region> find(const String& path) const;
+
+	// アトラスから取れる（取れる予定の）画像か
+	// テクスチャにするまでは start に渡したパス全て、その後はページに収まったものだけ（収まらない画像は先読みの対象）
+	bool isRequested(const String& path) const { return m_requested.contains(path); }
+
+	size_t pageCount() const { return m_pages.size(); }
+
+	// ページのテクスチャのメモリ量の目安
+	size_t byteSize() const
+	{
+		size_t bytes = 0;
+		for (const auto& page : m_pages)
+		{
+			bytes += TextureBytes(page.size());
+		}
+		return bytes;
+	}
+
+private:
+	// 詰めた結果（テクスチャにする前）
+	struct Packed
+	{
+		Array<Image> pages;
+		HashTable<String, std::pair<size_t, Rect>> regions;
+	};
+
+	// 画像を高さ順に棚詰めする（ページに収まらない画像はデコードせずに除く、どのスレッドから呼んでもよい）
+	static Packed Pack(const Array<String>& paths);
+
+	// 詰め終わった結果をテクスチャにする
+	void upload(Packed&& packed);
+
+	Array<Texture> m_pages;
+	HashTable<String, std::pair<size_t, Rect>> m_regions; // パス -> {ページ番号, 範囲}
+	HashSet<String> m_requested;
+	AsyncTask<Packed> m_task;
+};
+
+void TextureAtlas::start(const Array<String>& paths)
+{
+	m_requested = HashSet<String>(paths.begin(), paths.end());
+	m_task = Async([paths] { return Pack(paths); });
+}
+
+void TextureAtlas::update()
+{
+	if (m_task.isValid() && m_task.isReady())
+	{
+		upload(m_task.get());
+	}
+}
+
+void TextureAtlas::finish()
+{
+	if (m_task.isValid())
+	{
+		upload(m_task.get());
+	}
+}
+
+void TextureAtlas::upload(Packed&& packed)
+{
+	for (const auto& pageImage : packed.pages)
+	{
+		m_pages.emplace_back(pageImage);
+	}
+	m_regions = std::move(packed.regions);
+
+	// ページに収まらなかった画像は AssetCache の先読みに任せる
+	m_requested.clear();
+	for (const auto& [path, region] : m_regions)
+	{
+		m_requested.insert(path);
+	}
+}
+
+TextureAtlas::Packed TextureAtlas::Pack(const Array<String>& paths)
+{
+	Packed packed;
+	Array<std::pair<String, Image>> images;
+	for (const auto& path : paths)
+	{
+		// 大きさはヘッダだけ読んで調べる
+		const auto info = ImageDecoder::GetImageInfo(path);
+		if (not info || PageSize.x < info->size.x || PageSize.y < info->size.y) { continue; }
+
+		if (Image image{ path })
+		{
+			images.emplace_back(path, std::move(image));
+		}
+	}
+	std::stable_sort(images.begin(), images.end(), [](const auto& a, const auto& b) {
+		return a.second.height() > b.second.height();
+	});
+
+	// 位置を決める
+	Array<int32> pageHeights{ 0 };
+	Point cursor{ 0, 0 };
+	int32 shelfHeight = 0;
+	for (const auto& [path, image] : images)
+	{
+		if (PageSize.x < cursor.x + image.width())
+		{
+			// 次の棚へ
+			cursor = { 0, cursor.y + shelfHeight + Padding };
+			shelfHeight = 0;
+		}
+		if (PageSize.y < cursor.y + image.height())
+		{
+			// 次のページへ
+			pageHeights.push_back(0);
+			cursor = { 0, 0 };
+			shelfHeight = 0;
+		}
+
+		packed.regions[path] = { pageHeights.size() - 1, Rect{ cursor, image.size() } };
+		shelfHeight = Max(shelfHeight, image.height());
+		pageHeights.back() = Max(pageHeights.back(), cursor.y + image.height());
+		cursor.x += image.width() + Padding;
+	}
+
+	// ページ画像を作る
+	for (const auto& height : pageHeights)
+	{
+		packed.pages.emplace_back(Size{ PageSize.x, Max(height, 1) }, Color{ 0, 0, 0, 0 });
+	}
+	for (const auto& [path, image] : images)
+	{
+		const auto& [page, rect] = packed.regions.at(path);
+		image.overwrite(packed.pages[page], rect.pos);
+	}
+	return packed;
+}
+
+Optional<TextureAtlas::Region> TextureAtlas::find(const String& path) const
+{
+	if (auto it = m_regions.find(path); it != m_regions.end())
+	{
+		const auto& [page, rect] = it->second;
+		return Region{ m_pages[page], rect.pos, rect.size };
+	}
+	return none;
+}
+
+// シナリオの make で使われている画像のパス
+Array<String> CollectImagePaths(const ScenarioLibrary& library)
+{
+	Array<String> paths;
+	HashSet<String> pathSet;
+	for (const auto& [name, slot] : library.slots())
+	{
+		if (not slot->scenario) { continue; } // 読み込んでいないファイルのシナリオ
+
+		for (const auto& command : slot->scenario->commands)
+		{
+			for (const auto& desc : command.entities)
+			{
+				if (desc.image && pathSet.insert(desc.image->path).second)
+				{
+					paths.push_back(desc.image->path);
+				}
+			}
+		}
+	}
+	return paths;
+}
+
+// 最初に呼ばれたときに詰め始める（Main で起動時に呼んでおく）
+TextureAtlas& GetTextureAtlas()
+{
+	static TextureAtlas atlas = [] {
+		TextureAtlas atlas;
+		if (UseTextureAtlas)
+		{
+			atlas.start(CollectImagePaths(GetScenarioLibrary()));
+		}
+		return atlas;
+	}();
+	return atlas;
+}
+
+
+/*
+* AssetCache
+*/
+
+// テクスチャ（パスごと）とフォント（サイズ・書体ごと）を共有する
+// どこからも参照されなくなったものも上限数までは残しておき、再利用する
+// texture・font・layout はシミュレーションのスレッドから呼んでよい（画像のデコードと、作るものの記録だけをする）
+// テクスチャ・フォントの作成、文字の整形、追い出し（テクスチャの破棄）は update でメインスレッドが行う
+class AssetCache
+{
+public:
+	static constexpr size_t MaxUnusedTextures = 16;
+	static constexpr size_t MaxUnusedSheets = 16;
+	static constexpr size_t MaxUnusedFonts = 4;
+
+	std::shared_ptr<const CachedTexture> texture(const String& path);
+	std::shared_ptr<const SpriteSheet> sheet(const String& path, const Size& cellSize);
+	std::shared_ptr<const CachedFont> font(int32 size, Typeface typeface = Typeface::Regular);
+
+	// text を font で整形したもの（update で整形するまでは空）
+	std::shared_ptr<const TextComponent::Layout> layout(const String& text, const std::shared_ptr<const CachedFont>& font);
+
+	// 別スレッドで画像のデコードを始めておく
+	void prefetch(const String& path);
+
+	// 記録しておいたテクスチャ・フォントを作って文字を整形し、上限・予算を超えた分を追い出す
+	// デコードが終わった先読みの画像もテクスチャにする
+	// メインスレッドで毎フレーム、シミュレーションの止まっている間（描画の前）に呼ぶ
+	void update();
+
+	// テクスチャ・フォントのメモリ量の予算（バイト、0: 無制限）
+	// 超えている間、参照されていないものを上限数に関係なく古い順に追い出す
+	void setBudgets(size_t textureBytes, size_t fontBytes);
+
+	// 持っているもののメモリ量の目安（アトラスのページは含まない）
+	size_t textureBytes() const;
+	size_t fontBytes() const;
+
+	// f(asset, isUsed): 持っているもの全て（isUsed: キャッシュ以外から参照されている）
+	template<class F>
+	void forEachTexture(F&& f) const
+	{
+		for (const auto& [path, entry] : m_textures) { f(*entry.asset, entry.asset.use_count() != 1); }
+	}
+
+	template<class F>
+	void forEachFont(F&& f) const
+	{
+		for (const auto& [key, entry] : m_fonts) { f(*entry.asset, entry.asset.use_count() != 1); }
+	}
+
+private:
+	template<class Asset>
+	struct Entry
+	{
+		std::shared_ptr<const Asset> asset;
+		uint64 lastUsed = 0;
+	};
+
+	// 参照されていないものを古い順に上限数まで減らす
+	template<class Key, class Asset>
+	static void Trim(HashTable<Key, Entry<Asset>>& table, size_t maxUnused);
+
+	// 参照されていないものを、合計 bytes が budget 以下になるまで古い順に減らす
+	// bytesOf(asset): 1つ分のメモリ量
+	template<class Key, class Asset, class BytesOf>
+	static void TrimToBudget(HashTable<Key, Entry<Asset>>& table, size_t bytes, size_t budget, BytesOf&& bytesOf);
+
+	// 予算を超えていれば減らす
+	void trimToBudgets();
+
+	// テクスチャにするのは update で
+	std::shared_ptr<const CachedTexture> add(const String& path, Image&& image);
+
+	// update で作るもの
+	struct PendingLayout
+	{
+		std::shared_ptr<TextComponent::Layout> layout;
+		String text;
+		std::shared_ptr<const CachedFont> font;
+	};
+
+	HashTable<String, Entry<CachedTexture>> m_textures;
+	HashTable<String, Entry<SpriteSheet>> m_sheets; // "パス:幅x高さ" -> シート
+	HashTable<uint64, Entry<CachedFont>> m_fonts; // (サイズ << 8 | 書体) -> フォント
+	uint64 m_clock = 0;
+
+	size_t m_textureBudget = 0;
+	size_t m_fontBudget = 0;
+
+	HashTable<String, AsyncTask<Image>> m_pending; // デコード中の画像
+
+	Array<std::pair<std::shared_ptr<CachedTexture>, Image>> m_textureUploads;
+	Array<std::shared_ptr<CachedFont>> m_fontUploads;
+	Array<PendingLayout> m_pendingLayouts;
+	uint64 m_batchKeyCount = 0; // アトラスを使わないテクスチャの batchKey（ページの Texture の ID と重ならないように上位に置く）
+};
+
+std::shared_ptr<const CachedTexture> AssetCache::texture(const String& path)
+{
+	if (auto it = m_textures.find(path); it != m_textures.end())
+	{
+		it->second.lastUsed = ++m_clock;
+		return it->second.asset;
+	}
+
+	// アトラスにあればそれを使う
+	if (const auto region = GetTextureAtlas().find(path))
+	{
+		auto asset = std::make_shared<const CachedTexture>(CachedTexture{
+			path, region->texture, region->offset, region->size, 0, region->texture.id().value() });
+		m_textures.emplace(path, Entry<CachedTexture>{ asset, ++m_clock });
+		return asset;
+	}
+
+	// 先読み中ならデコードの完了を待つ
+	if (auto it = m_pending.find(path); it != m_pending.end())
+	{
+		Image image = it->second.get();
+		m_pending.erase(it);
+		return add(path, std::move(image));
+	}
+
+	return add(path, Image{ path });
+}
+
+void AssetCache::prefetch(const String& path)
+{
+	if (m_textures.contains(path) || m_pending.contains(path)) { return; }
+	if (GetTextureAtlas().isRequested(path)) { return; } // アトラスの方で読み込む（scenarios/ のファイルの画像などが先読みの対象）
+
+	m_pending.emplace(path, Async([path] { return Image{ path }; }));
+}
+
+void AssetCache::update()
+{
+	GetTextureAtlas().update();
+
+	for (auto it = m_pending.begin(); it != m_pending.end();)
+	{
+		if (it->second.isReady())
+		{
+			add(it->first, it->second.get());
+			it = m_pending.erase(it);
+		}
+		else
+		{
+			++it;
+		}
+	}
+
+	for (auto& [asset, image] : m_textureUploads)
+	{
+		asset->texture = Texture{ image };
+	}
+	m_textureUploads.clear();
+
+	for (const auto& asset : m_fontUploads)
+	{
+		asset->font = Font{ asset->size, asset->typeface };
+	}
+	m_fontUploads.clear();
+
+	for (const auto& pending : m_pendingLayouts)
+	{
+		*pending.layout = TextComponent::Shape(pending.text, pending.font->font);
+	}
+	m_pendingLayouts.clear();
+
+	// 先にシートを減らしておくと、シートからしか参照されていなかったテクスチャも減らせる
+	Trim(m_sheets, MaxUnusedSheets);
+	Trim(m_textures, MaxUnusedTextures);
+	Trim(m_fonts, MaxUnusedFonts);
+	trimToBudgets();
+}
+
+std::shared_ptr<const CachedTexture> AssetCache::add(const String& path, Image&& image)
+{
+	const Size size = image.size();
+	auto asset = std::make_shared<CachedTexture>(CachedTexture{
+		path, Texture{}, Point{ 0, 0 }, size, TextureBytes(size), (uint64{ 1 } << 62) + m_batchKeyCount++ });
+	m_textureUploads.emplace_back(asset, std::move(image));
+	m_textures.emplace(path, Entry<CachedTexture>{ asset, ++m_clock });
+	return asset;
+}
+
+std::shared_ptr<const SpriteSheet> AssetCache::sheet(const String& path, const Size& cellSize)
+{
+	const String key = U"{}:{}x{}"_fmt(path, cellSize.x, cellSize.y);
+	if (auto it = m_sheets.find(key); it != m_sheets.end())
+	{
+		it->second.lastUsed = ++m_clock;
+		return it->second.asset;
+	}
+
+	auto asset = std::make_shared<const SpriteSheet>(SpriteSheet::Make(texture(path), cellSize));
+	m_sheets.emplace(key, Entry<SpriteSheet>{ asset, ++m_clock });
+	return asset;
+}
+
+std::shared_ptr<const CachedFont> AssetCache::font(int32 size, Typeface typeface)
+{
+	const uint64 key = (static_cast<uint64>(size) << 8) | static_cast<uint64>(typeface);
+	if (auto it = m_fonts.find(key); it != m_fonts.end())
+	{
+		it->second.lastUsed = ++m_clock;
+		return it->second.asset;
+	}
+
+	auto asset = std::make_shared<CachedFont>(CachedFont{ size, typeface, Font{} });
+	m_fontUploads.push_back(asset);
+	m_fonts.emplace(key, Entry<CachedFont>{ asset, ++m_clock });
+	return asset;
+}
+
+std::shared_ptr<const TextComponent::Layout> AssetCache::layout(const String& text, const std::shared_ptr<const CachedFont>& font)
+{
+	auto layout = std::make_shared<TextComponent::Layout>();
+	m_pendingLayouts.push_back({ layout, text, font });
+	return layout;
+}
+
+void AssetCache::setBudgets(size_t textureBytes, size_t fontBytes)
+{
+	m_textureBudget = textureBytes;
+	m_fontBudget = fontBytes;
+	trimToBudgets();
+}
+
+size_t AssetCache::textureBytes() const
+{
+	size_t bytes = 0;
+	forEachTexture([&](const CachedTexture& texture, bool) { bytes += texture.byteSize; });
+	return bytes;
+}
+
+size_t AssetCache::fontBytes() const
+{
+	size_t bytes = 0;
+	forEachFont([&](const CachedFont& font, bool) { bytes += font.byteSize(); });
+	return bytes;
+}
+
+void AssetCache::trimToBudgets()
+{
+	if (m_textureBudget != 0 && m_textureBudget < textureBytes())
+	{
+		Trim(m_sheets, 0); // シートからしか参照されていないテクスチャも追い出せるようにする
+		TrimToBudget(m_textures, textureBytes(), m_textureBudget, [](const CachedTexture& texture) { return texture.byteSize; });
+	}
+
+	if (m_fontBudget != 0 && m_fontBudget < fontBytes())
+	{
+		TrimToBudget(m_fonts, fontBytes(), m_fontBudget, [](const CachedFont& font) { return font.byteSize(); });
+	}
+}
+
+template<class Key, class Asset>
+void AssetCache::Trim(HashTable<Key, Entry<Asset>>& table, size_t maxUnused)
+{
+	Array<std::pair<uint64, Key>> unused;
+	for (const auto& [key, entry] : table)
+	{
+		if (entry.asset.use_count() == 1) // キャッシュ以外から参照されていない
+		{
+			unused.emplace_back(entry.lastUsed, key);
+		}
+	}
+	if (unused.size() <= maxUnused) { return; }
+
+	std::sort(unused.begin(), unused.end(),
+		[](const auto& a, const auto& b) { return a.first < b.first; });
+	for (size_t i = 0; i < unused.size() - maxUnused; ++i)
+	{
+		table.erase(unused[i].second);
+	}
+}
+
+template<class Key, class Asset, class BytesOf>
+void AssetCache::TrimToBudget(HashTable<Key, Entry<Asset>>& table, size_t bytes, size_t budget, BytesOf&& bytesOf)
+{
+	Array<std::pair<uint64, Key>> unused;
+	for (const auto& [key, entry] : table)
+	{
+		if (entry.asset.use_count() == 1)
+		{
+			unused.emplace_back(entry.lastUsed, key);
+		}
+	}
+	std::sort(unused.begin(), unused.end(),
+		[](const auto& a, const auto& b) { return a.first < b.first; });
+
+	for (size_t i = 0; i < unused.size() && budget < bytes; ++i)
+	{
+		auto it = table.find(unused[i].second);
+		bytes -= Min(bytes, bytesOf(*it->second.asset));
+		table.erase(it);
+	}
+}
+
+AssetCache& GetAssetCache()
+{
+	static AssetCache cache;
+	return cache;
+}
+
+TextComponent TextComponent::Make(const String& text, const std::shared_ptr<const CachedFont>& font)
+{
+	return { text, font, GetAssetCache().layout(text, font) };
+}
+
+// シナリオのこの先で使う画像を先読みする
+// 先読みするコマンド数
+constexpr size_t PrefetchLookahead = 8;
+
+// scenario.commands[index] で使う画像を先読みする
+// push / reset 先のシナリオは depth 段まで先頭から辿る
+void PrefetchCommand(const CompiledScenario& scenario, size_t index, int32 depth = 1);
+
+// scenario.commands[begin] から PrefetchLookahead 個を先読みする
+void PrefetchCommands(const CompiledScenario& scenario, size_t begin, int32 depth = 1)
+{
+	for (size_t i = begin; i < Min(begin + PrefetchLookahead, scenario.commands.size()); ++i)
+	{
+		PrefetchCommand(scenario, i, depth);
+	}
+}
+
+void PrefetchCommand(const CompiledScenario& scenario, size_t index, int32 depth)
+{
+	if (scenario.commands.size() <= index) { return; }
+	const auto& command = scenario.commands[index];
+
+	for (const auto& desc : command.entities)
+	{
+		if (desc.image) { GetAssetCache().prefetch(desc.image->path); }
+	}
+
+	if (depth <= 0) { return; }
+
+	// 読み込んでいないファイルのシナリオは先読みのためには読み込まない
+	const auto prefetchScenario = [&](const ScenarioParam& scenarioParam) {
+		if (const auto* scenario = scenarioParam.slot->scenario)
+		{
+			PrefetchCommands(*scenario, 0, depth - 1);
+		}
+	};
+
+	if (const auto* scenarioParam = std::get_if<ScenarioParam>(&command.param))
+	{
+		prefetchScenario(*scenarioParam);
+	}
+	else if (const auto* adventureParam = std::get_if<AdventureParam>(&command.param))
+	{
+		for (const auto& [entityName, target] : adventureParam->link)
+		{
+			prefetchScenario(std::get<ScenarioParam>(target));
+		}
+	}
+	else if (const auto* parallelParam = std::get_if<ParallelParam>(&command.param))
+	{
+		for (const auto& track : parallelParam->tracks)
+		{
+			prefetchScenario(std::get<ScenarioParam>(track));
+		}
+	}
+}
+
+
+/*
+* State
+*/
+
+class State
+{
+public:
+	struct Action
+	{
+		enum class Type
+		{
+			NONE,
+			POP,
+			PUSH,
+			RESET, // clear + push
+			SLEEP, // wakeOn のどれかが押されるか、時刻が wakeTime になるまで update を呼ばない
+		};
+
+		Type type;
+		const StateParam* nextState; // 次の State は StateStack がこのパラメータから作る
+		const ScenarioPin* pin; // nextState の入っているシナリオの pin（次の State にコピーする、RESET で clear されても残る）
+		InputActions wakeOn;
+		double wakeTime;
+
+		static Action None() { return { Type::NONE, nullptr, nullptr, {}, Math::Inf }; }
+		static Action Pop() { return{ Type::POP, nullptr, nullptr, {}, Math::Inf }; }
+		static Action Push(const StateParam& param, const ScenarioPin& pin) { return{ Type::PUSH, &param, &pin, {}, Math::Inf }; }
+		static Action Reset(const StateParam& param, const ScenarioPin& pin) { return{ Type::RESET, &param, &pin, {}, Math::Inf }; }
+		static Action Sleep(InputActions wakeOn, double wakeTime = Math::Inf) { return{ Type::SLEEP, nullptr, nullptr, wakeOn, wakeTime }; }
+	};
+
+	// 各 State は以下を実装する（StateStack が std::visit で静的に呼び出す）
+	//   void onAfterPush(EntitySet& entities);
+	//   Action update(EntitySet& entities);
+	//   void onBeforePop(EntitySet& entities);
+	//   static constexpr StringView TypeName;
+	//   String getName() const;
+	//   void save(ScenarioBinary::Encoder& encoder) const; // セーブデータ
+	//   XxxState(ScenarioBinary::Decoder& decoder, EntitySet& entities); // セーブデータから（onAfterPush は呼ばない）
+	// パラメータを参照し続ける State は XxxState(PinnedParam<Param>) で作り、pin を pop まで持つ
+};
+
+// State が参照しているパラメータを、シナリオ名とコマンドの番号で書く・読む
+template<class Param>
+void WriteParamRef(ScenarioBinary::Encoder& encoder, const Param& param)
+{
+	const auto [name, index] = GetScenarioLibrary().locate(param);
+	encoder.writeString(name);
+	encoder.write(index);
+}
+
+template<class Param>
+PinnedParam<Param> ReadParamRef(ScenarioBinary::Decoder& decoder)
+{
+	const String name{ decoder.readString() };
+	return GetScenarioLibrary().paramAt<Param>(name, decoder.read<uint32>());
+}
+
+
+/*
+* WaitState
+*/
+
+class WaitState : public State
+{
+public:
+	using Param = WaitParam;
+
+	WaitState(const WaitParam& param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	WaitState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"WaitState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	const double m_seconds;
+	double m_endTime = 0.0; // FrameInput::time でこの時刻になったら pop
+};
+
+WaitState::WaitState(const WaitParam& param)
+	: m_seconds{ param.seconds }
+{
+}
+
+// 時刻は起動ごとに 0 から始まるので、残り時間で書く
+void WaitState::save(ScenarioBinary::Encoder& encoder) const
+{
+	encoder.write(m_seconds);
+	encoder.write(m_endTime - GetFrameInput().time);
+}
+
+WaitState::WaitState(ScenarioBinary::Decoder& decoder, EntitySet&)
+	: m_seconds{ decoder.read<double>() }
+	, m_endTime{ GetFrameInput().time + decoder.read<double>() }
+{
+}
+
+void WaitState::onAfterPush(EntitySet&)
+{
+	m_endTime = GetFrameInput().time + m_seconds;
+}
+
+State::Action WaitState::update(EntitySet&)
+{
+	// 終わる時刻まで StateStack に眠らせてもらう
+	return (GetFrameInput().time < m_endTime) ? Action::Sleep({}, m_endTime) : Action::Pop();
+}
+
+void WaitState::onBeforePop(EntitySet&)
+{
+}
+
+
+/*
+* SpeakState
+*/
+
+class SpeakState : public State
+{
+public:
+	using Param = SpeakParam;
+
+	SpeakState(PinnedParam<SpeakParam> param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	SpeakState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"SpeakState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	const SpeakParam& m_param; // ScenarioLibrary が持っている
+	ScenarioPin m_pin; // m_param の入っているシナリオを捨てさせない
+
+	Entity m_speakEntity; // 吹き出しのEntity
+};
+
+SpeakState::SpeakState(PinnedParam<SpeakParam> param)
+	: m_param{ param.param }
+	, m_pin{ std::move(param.pin) }
+{
+}
+
+void SpeakState::save(ScenarioBinary::Encoder& encoder) const
+{
+	WriteParamRef(encoder, m_param);
+	encoder.write(m_speakEntity);
+}
+
+SpeakState::SpeakState(ScenarioBinary::Decoder& decoder, EntitySet&)
+	: SpeakState{ ReadParamRef<SpeakParam>(decoder) }
+{
+	m_speakEntity = decoder.read<Entity>();
+}
+
+void SpeakState::onAfterPush(EntitySet& entities)
+{
+	const auto entityPosC = entities.posTable.at(entities.find(m_param.entityName));
+	const Vec3 pos{
+		entityPosC.pos.x + m_param.offset.x,
+		entityPosC.pos.y + m_param.offset.y,
+		1.0
+	};
+
+	m_speakEntity = entities.create(m_param.speakEntityName);
+	entities.posTable.insert(m_speakEntity, { pos });
+	entities.textTable.insert(m_speakEntity, TextComponent::Make(m_param.text, GetAssetCache().font(20)));
+}
+
+State::Action SpeakState::update(EntitySet& entities)
+{
+	if (GetFrameInput().down.contains(InputAction::DECIDE))
+	{
+		return Action::Pop(); // 決定キーで終了
+	}
+	return Action::Sleep(InputAction::DECIDE);
+}
+
+void SpeakState::onBeforePop(EntitySet& entities)
+{
+	entities.erase(m_speakEntity);
+}
+
+
+/*
+* WalkState
+*/
+
+class WalkState : public State
+{
+public:
+	using Param = WalkParam;
+
+	WalkState(const WalkParam& param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	WalkState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"WalkState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	const Symbol m_entityName;
+	const double m_to;
+	const double m_speed;
+
+	Entity m_entity; // onAfterPushで名前から解決
+};
+
+WalkState::WalkState(const WalkParam& param)
+	: m_entityName{ param.entityName }
+	, m_to{ param.to }
+	, m_speed{ param.speed }
+{
+}
+
+void WalkState::save(ScenarioBinary::Encoder& encoder) const
+{
+	encoder.writeString(m_entityName);
+	encoder.write(m_to);
+	encoder.write(m_speed);
+	encoder.write(m_entity);
+}
+
+// 補間の途中経過は tweenTable と一緒に保存されている
+WalkState::WalkState(ScenarioBinary::Decoder& decoder, EntitySet&)
+	: m_entityName{ decoder.readSymbol() }
+	, m_to{ decoder.read<double>() }
+	, m_speed{ decoder.read<double>() }
+	, m_entity{ decoder.read<Entity>() }
+{
+}
+
+void WalkState::onAfterPush(EntitySet& entities)
+{
+	m_entity = entities.find(m_entityName);
+
+	// 補間は tweenTable に登録して updateSystems でまとめて進める
+	const double from = entities.posTable.at(m_entity).pos.x;
+	startTween(entities, m_entity, TweenProperty::X, m_to, Abs(m_to - from) / m_speed, Easing::LINEAR);
+
+	if (entities.animationTable.contains(m_entity)) { return; } // 向きもアニメーションに任せる
+
+	auto& imageC = entities.imageTable.at(m_entity);
+	if (m_to < from)
+	{
+		imageC.imagePos.x = 1; // 左向き
+	}
+	else if (from < m_to)
+	{
+		imageC.imagePos.x = 2; // 右向き
+	}
+}
+
+State::Action WalkState::update(EntitySet& entities)
+{
+	// 歩き終わると tweenTable から消える
+	return entities.tweenTable.contains(m_entity, TweenProperty::X) ? Action::None() : Action::Pop();
+}
+
+void WalkState::onBeforePop(EntitySet&)
+{
+}
+
+
+/*
+* AnimState
+*/
+
+class AnimState : public State
+{
+public:
+	using Param = AnimParam;
+
+	AnimState(const AnimParam& param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	AnimState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"AnimState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	const Symbol m_entityName;
+	const Point m_imagePos;
+	const bool m_isHidden;
+};
+
+AnimState::AnimState(const AnimParam& param)
+	: m_entityName{ param.entityName }
+	, m_imagePos{ param.imagePos }
+	, m_isHidden{ param.isHidden }
+{
+}
+
+void AnimState::save(ScenarioBinary::Encoder& encoder) const
+{
+	encoder.writeString(m_entityName);
+	encoder.write(m_imagePos.x);
+	encoder.write(m_imagePos.y);
+	encoder.write<uint8>(m_isHidden);
+}
+
+AnimState::AnimState(ScenarioBinary::Decoder& decoder, EntitySet&)
+	: m_entityName{ decoder.readSymbol() }
+	, m_imagePos{ decoder.read<int32>(), decoder.read<int32>() }
+	, m_isHidden{ decoder.read<uint8>() != 0 }
+{
+}
+
+void AnimState::onAfterPush(EntitySet& entities)
+{
+	const Entity entity = entities.find(m_entityName);
+	entities.animationTable.erase(entity); // 再生中のアニメーションは止めて、指定のコマにする
+
+	auto& imageC = entities.imageTable.at(entity);
+	imageC.imagePos = m_imagePos;
+	imageC.isHidden = m_isHidden;
+}
+
+State::Action AnimState::update(EntitySet&)
+{
+	return Action::Pop();
+}
+
+void AnimState::onBeforePop(EntitySet&)
+{
+}
+
+
+/*
+* TweenState
+*/
+
+// TweenParam の補間をまとめて tweenTable に登録する
+// 進めるのは updateSystems なので、対象が何個あってもこの State は1つ
+class TweenState : public State
+{
+public:
+	using Param = TweenParam;
+
+	TweenState(PinnedParam<TweenParam> param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	TweenState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"TweenState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	void resolve(const EntitySet& entities);
+
+	const TweenParam& m_param; // ScenarioLibrary が持っている
+	ScenarioPin m_pin; // m_param の入っているシナリオを捨てさせない
+
+	Array<Entity> m_entities; // m_param.targets と同じ並び（onAfterPushで名前から解決）
+};
+
+TweenState::TweenState(PinnedParam<TweenParam> param)
+	: m_param{ param.param }
+	, m_pin{ std::move(param.pin) }
+{
+}
+
+void TweenState::save(ScenarioBinary::Encoder& encoder) const
+{
+	WriteParamRef(encoder, m_param);
+}
+
+// 補間の途中経過は tweenTable と一緒に保存されている
+TweenState::TweenState(ScenarioBinary::Decoder& decoder, EntitySet& entities)
+	: TweenState{ ReadParamRef<TweenParam>(decoder) }
+{
+	resolve(entities);
+}
+
+void TweenState::resolve(const EntitySet& entities)
+{
+	m_entities.clear();
+	m_entities.reserve(m_param.targets.size());
+	for (const auto& target : m_param.targets)
+	{
+		m_entities.push_back(entities.find(target.entityName));
+	}
+}
+
+void TweenState::onAfterPush(EntitySet& entities)
+{
+	resolve(entities);
+	for (size_t i = 0; i < m_param.targets.size(); ++i)
+	{
+		const auto& target = m_param.targets[i];
+		startTween(entities, m_entities[i], target.property, target.to, m_param.duration, m_param.easing);
+	}
+}
+
+State::Action TweenState::update(EntitySet& entities)
+{
+	if (not m_param.isWaiting) { return Action::Pop(); }
+
+	for (size_t i = 0; i < m_param.targets.size(); ++i)
+	{
+		if (entities.tweenTable.contains(m_entities[i], m_param.targets[i].property)) { return Action::None(); }
+	}
+	return Action::Pop();
+}
+
+void TweenState::onBeforePop(EntitySet&)
+{
+}
+
+
+/*
+* AdventureState
+*/
+
+class AdventureState : public State
+{
+public:
+	using Param = AdventureParam;
+
+	AdventureState(PinnedParam<AdventureParam> param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	AdventureState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"AdventureState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	const AdventureParam& m_param; // ScenarioLibrary が持っている
+	ScenarioPin m_pin; // m_param の入っているシナリオを捨てさせない
+
+	// onAfterPushで名前から解決したもの
+	Entity m_entity;
+	Array<std::pair<Entity, const StateParam*>> m_linkEntities; // Entity.index 順
+
+	// 紐づけられたシナリオ（無い場合は nullptr）
+	const StateParam* findLink(Entity entity) const;
+};
+
+AdventureState::AdventureState(PinnedParam<AdventureParam> param)
+	: m_param{ param.param }
+	, m_pin{ std::move(param.pin) }
+{
+}
+
+void AdventureState::save(ScenarioBinary::Encoder& encoder) const
+{
+	WriteParamRef(encoder, m_param);
+}
+
+// 名前から解決したものは保存せず、読み込んだ EntitySet から引き直す
+AdventureState::AdventureState(ScenarioBinary::Decoder& decoder, EntitySet& entities)
+	: AdventureState{ ReadParamRef<AdventureParam>(decoder) }
+{
+	onAfterPush(entities);
+}
+
+void AdventureState::onAfterPush(EntitySet& entities)
+{
+	m_entity = entities.find(m_param.entityName);
+
+	m_linkEntities.clear();
+	for (const auto& [targetName, scenarioParam] : m_param.link)
+	{
+		m_linkEntities.emplace_back(entities.find(targetName), &scenarioParam);
+	}
+	std::sort(m_linkEntities.begin(), m_linkEntities.end(),
+		[](const auto& a, const auto& b) { return a.first.index < b.first.index; });
+}
+
+const StateParam* AdventureState::findLink(Entity entity) const
+{
+	auto it = std::lower_bound(m_linkEntities.begin(), m_linkEntities.end(), entity.index,
+		[](const auto& link, uint32 index) { return link.first.index < index; });
+	return (it != m_linkEntities.end() && it->first == entity) ? it->second : nullptr;
+}
+
+// ScenarioStateを参照するので、Adventure::updateは下で実装
+
+void AdventureState::onBeforePop(EntitySet&)
+{
+}
+
+
+/*
+* ScenarioState
+*/
+
+class ScenarioState : public State
+{
+public:
+	using Param = ScenarioParam;
+
+	ScenarioState(const String& scenarioName);
+	ScenarioState(const ScenarioParam& param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	ScenarioState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"ScenarioState";
+
+	String getName() const
+	{
+		return String{ TypeName } + U"[[" + m_scenario.name + U"]]";
+	}
+
+	const ScenarioSlot& slot() const { return m_slot; }
+
+private:
+	ScenarioState(const ScenarioSlot& slot, ScenarioLibrary::Acquired&& acquired);
+
+	void makeEntities(EntitySet& entities, const Array<EntityDesc>& descs);
+
+	// シナリオ管理
+	const ScenarioSlot& m_slot;
+	const CompiledScenario& m_scenario; // push されたときの版（ホットリロードされても変わらない）
+	ScenarioPin m_pin; // 実行中は版・ファイルを捨てさせない（push するパラメータにも渡す）
+	size_t m_now = 0; // 次に実行するコマンドの番号
+
+	// ここで作ったEntity（pop時に削除する用）
+	Array<Entity> m_entitiesMadeOnThis;
+};
+
+ScenarioState::ScenarioState(const String& scenarioName)
+	: ScenarioState{ ScenarioParam{ GetSymbolTable().intern(scenarioName), &GetScenarioLibrary().resolve(scenarioName) } }
+{
+}
+
+ScenarioState::ScenarioState(const ScenarioParam& param)
+	: ScenarioState{ *param.slot, param.slot->fileName.isEmpty()
+		? ScenarioLibrary::Acquired{ *param.slot->scenario, param.slot->version }
+		: GetScenarioLibrary().acquire(*param.slot) }
+{
+}
+
+ScenarioState::ScenarioState(const ScenarioSlot& slot, ScenarioLibrary::Acquired&& acquired)
+	: m_slot{ slot }
+	, m_scenario{ acquired.scenario }
+	, m_pin{ std::move(acquired.pin) }
+{
+}
+
+void ScenarioState::save(ScenarioBinary::Encoder& encoder) const
+{
+	encoder.writeString(m_slot.name);
+	encoder.write<uint32>(static_cast<uint32>(m_now));
+	encoder.write<uint32>(static_cast<uint32>(m_entitiesMadeOnThis.size()));
+	for (const auto& entity : m_entitiesMadeOnThis)
+	{
+		encoder.write(entity);
+	}
+}
+
+// 名前から今の版を引く（保存したときの版がホットリロードで置き換わっていても、今の版の同じ位置から続ける）
+ScenarioState::ScenarioState(ScenarioBinary::Decoder& decoder, EntitySet&)
+	: ScenarioState{ String{ decoder.readString() } }
+{
+	m_now = decoder.read<uint32>();
+	if (m_scenario.commands.size() < m_now) { throw std::runtime_error{ "SaveData: bad command index" }; }
+
+	m_entitiesMadeOnThis.resize(decoder.readCount(sizeof(Entity)));
+	for (auto& entity : m_entitiesMadeOnThis)
+	{
+		entity = decoder.read<Entity>();
+	}
+
+	PrefetchCommands(m_scenario, m_now);
+}
+
+void ScenarioState::onAfterPush(EntitySet&)
+{
+	PrefetchCommands(m_scenario, 0);
+}
+
+State::Action ScenarioState::update(EntitySet& entities)
+{
+	// 最後まで読んだら pop
+	if (m_now == m_scenario.commands.size()) { return Action::Pop(); }
+
+	const auto& command = m_scenario.commands[m_now];
+	++m_now;
+
+	// 先読みの範囲に新しく入ったコマンド
+	PrefetchCommand(m_scenario, m_now + PrefetchLookahead - 1);
+
+	switch (command.type)
+	{
+	case ScenarioCommand::Type::MAKE:
+		// Entity作成
+		makeEntities(entities, command.entities);
+		return Action::None();
+
+	case ScenarioCommand::Type::PUSH:
+		return Action::Push(command.param, m_pin);
+
+	case ScenarioCommand::Type::RESET:
+		return Action::Reset(command.param, m_pin);
+	}
+
+	return Action::None();
+}
 
 void ScenarioState::onBeforePop(EntitySet& entities)
 {
-	for (const auto& name : m_nameSetMadeOnThis)
+	// 後に作ったものほど各配列の末尾にあるので、まとめて切り詰めてもらう
+	entities.erase(m_entitiesMadeOnThis);
+}
+
+void ScenarioState::makeEntities(EntitySet& entities, const Array<EntityDesc>& descs)
+{
+	static const uint32 zone = GetFrameProfiler().zone(U"ScenarioState::makeEntities");
+	ProfileScope scope{ zone };
+
+	// 先にまとめて確保してから Entity を作る
+	entities.reserve(descs.size());
+	m_entitiesMadeOnThis.reserve(m_entitiesMadeOnThis.size() + descs.size());
+	const size_t first = m_entitiesMadeOnThis.size();
+	for (const auto& desc : descs)
+	{
+		m_entitiesMadeOnThis.push_back(entities.create(desc.name));
+	}
+
+	// Component は種類ごとにまとめて追加する
+	for (size_t i = 0; i < descs.size(); ++i)
+	{
+		if (descs[i].pos)
+		{
+			entities.posTable.insert(m_entitiesMadeOnThis[first + i], *descs[i].pos);
+		}
+	}
+
+	for (size_t i = 0; i < descs.size(); ++i)
+	{
+		if (const auto& image = descs[i].image)
+		{
+			entities.imageTable.insert(m_entitiesMadeOnThis[first + i], {
+				GetAssetCache().sheet(image->path, image->imageSize),
+				image->imagePos,
+				image->isHidden,
+			});
+		}
+	}
+
+	for (size_t i = 0; i < descs.size(); ++i)
+	{
+		if (descs[i].animation)
+		{
+			entities.animationTable.insert(m_entitiesMadeOnThis[first + i], { descs[i].animation });
+		}
+	}
+
+	for (size_t i = 0; i < descs.size(); ++i)
+	{
+		if (const auto& text = descs[i].text)
+		{
+			entities.textTable.insert(m_entitiesMadeOnThis[first + i],
+				TextComponent::Make(text->text, GetAssetCache().font(text->fontSize)));
+		}
+	}
+}
+
+// AdventureState::updateの実装
+State::Action AdventureState::update(EntitySet& entities)
+{
+	const auto& input = GetFrameInput();
+	double x = entities.posTable.at(m_entity).pos.x;
+	auto& imageC = entities.imageTable.at(m_entity);
+	const bool isAnimated = entities.animationTable.contains(m_entity); // 向きもアニメーションに任せる
+	if (input.pressed.contains(InputAction::LEFT))
+	{
+		x -= 100.0 * input.deltaTime;
+		if (not isAnimated) { imageC.imagePos.x = 1; }
+	}
+	else if (input.pressed.contains(InputAction::RIGHT))
+	{
+		x += 100.0 * input.deltaTime;
+		if (not isAnimated) { imageC.imagePos.x = 2; }
+	}
+	x = Clamp(x, 0.0, 640.0);
+	entities.posTable.setX(m_entity, x);
+
+
+	if (not input.down.contains(InputAction::DECIDE))
+	{
+		// 何も押されていなければ、次に押されるまで眠る
+		const InputActions moves = InputActions{ InputAction::LEFT } | InputAction::RIGHT;
+		return input.pressed.intersects(moves) ? Action::None() : Action::Sleep(moves | InputAction::DECIDE);
+	}
+
+	// 近くにある紐づけられたEntityを索引から探す
+	const StateParam* next = nullptr;
+	entities.queryX(x - 60.0, x + 60.0, [&](Entity target) {
+		if (not next) { next = findLink(target); }
+	});
+
+	return next ? Action::Push(*next, m_pin) : Action::None();
+}
+
+
+/*
+* ParallelState
+*/
+
+class StateStack;
+
+// 複数のシナリオを別々のスタック（トラック）で同時に進める
+// 全てのトラックが空になったら pop
+class ParallelState : public State
+{
+public:
+	using Param = ParallelParam;
+
+	ParallelState(PinnedParam<ParallelParam> param);
+
+	void save(ScenarioBinary::Encoder& encoder) const;
+	ParallelState(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+
+	void onAfterPush(EntitySet& entities);
+	Action update(EntitySet& entities);
+	void onBeforePop(EntitySet& entities);
+
+	static constexpr StringView TypeName = U"ParallelState";
+
+	String getName() const
+	{
+		return String{ TypeName };
+	}
+
+private:
+	const ParallelParam& m_param; // ScenarioLibrary が持っている
+	ScenarioPin m_pin; // m_param の入っているシナリオを捨てさせない
+
+	Array<StateStack> m_tracks; // StateStack はこの後で定義する
+};
+
+
+/*
+* StateStack
+*/
+
+// State の種類の一覧
+// 種類が閉じているので std::variant に直接格納し、std::visit で呼び分ける
+template<class... StateTypes>
+struct StateRegistry
+{
+	using Variant = std::variant<StateTypes...>;
+
+	// パラメータの種類と State の種類が同じ順で並んでいること
+	static_assert(std::is_same_v<
+		std::variant<typename StateTypes::Param...>,
+		StateParam>);
+
+	// Variant の index -> State の種類名
+	static constexpr std::array<StringView, sizeof...(StateTypes)> TypeNames{ StateTypes::TypeName... };
+
+	// Variant の index -> Profiler の区間（種類ごとに最初の1回だけ登録する）
+	static uint32 Zone(size_t index)
+	{
+		static const std::array<uint32, sizeof...(StateTypes)> Zones{ GetFrameProfiler().zone(String{ StateTypes::TypeName })... };
+		return Zones[index];
+	}
+
+	// Variant の index の State をセーブデータから作る
+	static Variant Load(size_t index, ScenarioBinary::Decoder& decoder, EntitySet& entities)
+	{
+		using Loader = Variant(*)(ScenarioBinary::Decoder&, EntitySet&);
+		static constexpr std::array<Loader, sizeof...(StateTypes)> Loaders{
+			[](ScenarioBinary::Decoder& d, EntitySet& e) { return Variant{ std::in_place_type<StateTypes>, d, e }; }...
+		};
+		if (Loaders.size() <= index) { throw std::runtime_error{ "SaveData: bad state type" }; }
+		return Loaders[index](decoder, entities);
+	}
+};
+
+using States = StateRegistry<WaitState, SpeakState, WalkState, AnimState, AdventureState, ScenarioState, ParallelState, TweenState>;
+using AnyState = States::Variant;
+
+
+/*
+* TransitionLog
+*/
+
+// StateStack の push/pop の記録
+// メインスレッドは固定長のリングに POD を書くだけで、文字列にするのは別スレッドで行う
+// 表示 (F3) もファイル出力 (--trace-transitions) も無効のときは何もしない
+class TransitionLog
+{
+public:
+	struct Event
+	{
+		enum class Type : uint8
+		{
+			PUSH,
+			POP,
+		};
+
+		Type type;
+		uint8 stateType; // AnyState の index（POP では使わない）
+		uint16 depth; // push する前・pop した後のスタックの深さ
+		uint64 frame;
+		Symbol scenario; // ScenarioState のときのシナリオ名（それ以外は空）
+		// ScenarioSlot は持たない（ベンチマークの ScenarioLibrary などは、取り出す前に置き場所ごと消える）
+	};
+
+	static constexpr size_t Capacity = 4096; // リングの大きさ（2の累乗）
+	static constexpr size_t MaxViewLines = 24;
+
+	// 取り出すときに名前を読むので、SymbolTable を先に作っておく（こちらより後に破棄される）
+	TransitionLog() { GetSymbolTable(); }
+	~TransitionLog() { stop(); }
+
+	bool isEnabled() const { return m_isEnabled.load(std::memory_order_relaxed); }
+
+	// シミュレーションを進めているスレッドから呼ぶ（リングが一杯のときは捨てる）
+	void record(const Event& event)
+	{
+		if (not isEnabled()) { return; }
+
+		const size_t head = m_head.load(std::memory_order_relaxed);
+		if (head - m_tail.load(std::memory_order_acquire) == Capacity)
+		{
+			m_droppedCount.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		m_events[head % Capacity] = event;
+		m_head.store(head + 1, std::memory_order_release);
+	}
+
+	// 書き出し先のファイルを開いて記録を始める
+	void openFile(FilePathView path);
+
+	// F3: 画面への表示の切替
+	void handleInput();
+	void drawView() const;
+
+private:
+	void start();
+	void stop();
+
+	// 別スレッドでリングから取り出して文字列にする
+	void consume();
+	static String Format(const Event& event);
+
+	std::array<Event, Capacity> m_events;
+	std::atomic<size_t> m_head{ 0 }; // 次に書く位置（シミュレーションのスレッドだけが書き換える）
+	std::atomic<size_t> m_tail{ 0 }; // 次に読む位置（consume だけが書き換える）
+	std::atomic<uint64> m_droppedCount{ 0 };
+	std::atomic<bool> m_isEnabled{ false };
+
+	std::thread m_consumer;
+	TextWriter m_file; // consume からだけ書く
+	bool m_isFileOpen = false;
+	bool m_isViewVisible = false;
+
+	mutable std::mutex m_viewMutex;
+	Array<String> m_viewLines; // 画面に出す直近の行
+	Font m_font{ 12 }; // AssetCache はシミュレーション中に描画から触らない
+};
+
+TransitionLog& GetTransitionLog()
+{
+	static TransitionLog log;
+	return log;
+}
+
+
+class StateStack
+{
+public:
+	// シナリオ init から始める
+	StateStack();
+
+	// root から始める（ParallelState のトラック用、pin: root の入っているシナリオの pin）
+	StateStack(EntitySet& entities, const StateParam& root, const ScenarioPin& pin = nullptr);
+
+	// セーブデータから（各 State の onAfterPush は呼ばない）
+	StateStack(ScenarioBinary::Decoder& decoder, EntitySet& entities);
+	void save(ScenarioBinary::Encoder& encoder) const;
+
+	void update(EntitySet& entities);
+
+	bool isEmpty() const { return m_stack.empty(); }
+
+	// 眠っている top を起こす条件
+	struct WakeCondition
+	{
+		InputActions actions;
+		double time; // Math::Inf: 時刻では起きない
+	};
+
+	// top が眠っていないときは none（空のときは何があっても起きない条件）
+	Optional<WakeCondition> wakeCondition() const
+	{
+		if (m_stack.empty()) { return WakeCondition{ {}, Math::Inf }; }
+		if (m_wakeOn.isEmpty() && m_wakeTime == Math::Inf) { return none; }
+		return WakeCondition{ m_wakeOn, m_wakeTime };
+	}
+
+	// top の update を呼んだ回数（眠っている間は増えない）
+	uint64 updateCount() const { return m_updateCount; }
+
+	// 全て pop する
+	void clear(EntitySet& entities);
+
+private:
+	void pop(EntitySet& entities);
+	void push(EntitySet& entities, AnyState&& nextState);
+
+	// TransitionLog に push/pop を記録する
+	void record(TransitionLog::Event::Type type, size_t depth) const;
+
+	// パラメータに対応する State を作る
+	// pin: param の入っているシナリオの pin（パラメータを参照し続ける State に持たせる）
+	static AnyState MakeState(const StateParam& param, const ScenarioPin& pin = nullptr);
+
+	// MakeState と同じ（シナリオを読み込めないときは ScenarioErrorLog に書いて none、スタックはそのまま）
+	static Optional<AnyState> TryMakeState(const StateParam& param, const ScenarioPin& pin = nullptr);
+
+	// top以外のデータも見たいのでArrayで実装
+	// 末尾以外のデータを編集しないように気を付ける
+	// State はヒープに置かず配列の中に直接持つ
+	Array<AnyState> m_stack;
+
+	// top が Action::Sleep で待っている操作と時刻（空・Math::Inf: 毎 tick update する）
+	// push/pop で top が変わると戻る
+	InputActions m_wakeOn;
+	double m_wakeTime = Math::Inf;
+
+	uint64 m_updateCount = 0;
+};
+
+StateStack::StateStack()
+{
+	m_stack.reserve(16);
+	m_stack.emplace_back(std::in_place_type<ScenarioState>, U"init");
+	record(TransitionLog::Event::Type::PUSH, 0);
+}
+
+StateStack::StateStack(EntitySet& entities, const StateParam& root, const ScenarioPin& pin)
+{
+	m_stack.reserve(16);
+	if (auto state = TryMakeState(root, pin)) // 読み込めないトラックは空のまま（ParallelState が取り除く）
+	{
+		push(entities, std::move(*state));
+	}
+}
+
+StateStack::StateStack(ScenarioBinary::Decoder& decoder, EntitySet& entities)
+{
+	const uint32 count = decoder.readCount(sizeof(uint8));
+	m_stack.reserve(Max<size_t>(count, 16));
+	for (uint32 i = 0; i < count; ++i)
+	{
+		const size_t depth = m_stack.size();
+		m_stack.push_back(States::Load(decoder.read<uint8>(), decoder, entities));
+		record(TransitionLog::Event::Type::PUSH, depth);
+	}
+	m_wakeOn.bits = decoder.read<uint8>();
+	m_wakeTime = GetFrameInput().time + decoder.read<double>();
+}
+
+void StateStack::save(ScenarioBinary::Encoder& encoder) const
+{
+	encoder.write<uint32>(static_cast<uint32>(m_stack.size()));
+	for (const auto& anyState : m_stack)
+	{
+		encoder.write<uint8>(static_cast<uint8>(anyState.index()));
+		std::visit([&](const auto& state) { state.save(encoder); }, anyState);
+	}
+	encoder.write(m_wakeOn.bits);
+	encoder.write(m_wakeTime - GetFrameInput().time); // WaitState と同じく残り時間で書く
+}
+
+void StateStack::clear(EntitySet& entities)
+{
+	while (not m_stack.empty()) { pop(entities); }
+}
+
+void StateStack::update(EntitySet& entities)
+{
+	if (m_stack.empty()) { return; }
+
+	// 眠っている top は、待っている操作が押されるか時刻になるまで呼ばない
+	if (const auto wake = wakeCondition())
+	{
+		const auto& input = GetFrameInput();
+		if (not (input.down.intersects(wake->actions) || wake->time <= input.time)) { return; }
+		m_wakeOn = {};
+		m_wakeTime = Math::Inf;
+	}
+	++m_updateCount;
+
+	static const uint32 zone = GetFrameProfiler().zone(U"StateStack::update");
+	ProfileScope scope{ zone };
+
+	// Stateの更新して、スタック操作を取得
+	auto [type, nextState, pin, wakeOn, wakeTime] = [&] {
+		ProfileScope stateScope{ States::Zone(m_stack.back().index()) };
+		return std::visit([&](auto& state) { return state.update(entities); }, m_stack.back());
+	}();
+
+	switch (type)
+	{
+	case State::Action::Type::NONE:
+		break;
+
+	case State::Action::Type::POP:
+		pop(entities);
+		break;
+
+	case State::Action::Type::PUSH:
+		if (auto state = TryMakeState(*nextState, *pin))
+		{
+			push(entities, std::move(*state));
+		}
+		break;
+
+	case State::Action::Type::RESET:
+		// パラメータを持っている State を pop する前に作っておく（pin をコピーするので clear 後も残る）
+		if (auto state = TryMakeState(*nextState, *pin))
+		{
+			clear(entities);
+			push(entities, std::move(*state));
+		}
+		break;
+
+	case State::Action::Type::SLEEP:
+		m_wakeOn = wakeOn;
+		m_wakeTime = wakeTime;
+		break;
+	}
+}
+
+void StateStack::pop(EntitySet& entities)
+{
+	std::visit([&](auto& state) { state.onBeforePop(entities); }, m_stack.back());
+	m_stack.pop_back();
+	m_wakeOn = {};
+	m_wakeTime = Math::Inf;
+
+	record(TransitionLog::Event::Type::POP, m_stack.size());
+}
+
+void StateStack::push(EntitySet& entities, AnyState&& nextState)
+{
+	const size_t depth = m_stack.size();
+	m_stack.push_back(std::move(nextState));
+	m_wakeOn = {};
+	m_wakeTime = Math::Inf;
+	std::visit([&](auto& state) { state.onAfterPush(entities); }, m_stack.back());
+
+	record(TransitionLog::Event::Type::PUSH, depth);
+}
+
+void StateStack::record(TransitionLog::Event::Type type, size_t depth) const
+{
+	auto& log = GetTransitionLog();
+	if (not log.isEnabled()) { return; }
+
+	const ScenarioState* scenarioState = (type == TransitionLog::Event::Type::PUSH)
+		? std::get_if<ScenarioState>(&m_stack.back())
+		: nullptr;
+
+	log.record({
+		type,
+		static_cast<uint8>((type == TransitionLog::Event::Type::PUSH) ? m_stack.back().index() : 0),
+		static_cast<uint16>(depth),
+		GetFrameInput().frameCount,
+		scenarioState ? scenarioState->slot().symbol : Symbol{},
+	});
+}
+
+Optional<AnyState> StateStack::TryMakeState(const StateParam& param, const ScenarioPin& pin)
+{
+	try
+	{
+		return MakeState(param, pin);
+	}
+	catch (const std::exception& e)
+	{
+		GetScenarioErrorLog().report(U"シナリオを読み込めませんでした: " + Unicode::Widen(e.what()));
+		return none;
+	}
+}
+
+AnyState StateStack::MakeState(const StateParam& param, const ScenarioPin& pin)
+{
+	return std::visit([&](const auto& p) {
+		using ParamType = std::decay_t<decltype(p)>;
+		using StateType = typename ParamType::StateType;
+		if constexpr (std::is_constructible_v<StateType, PinnedParam<ParamType>>)
+		{
+			return AnyState{ std::in_place_type<StateType>, PinnedParam<ParamType>{ p, pin } };
+		}
+		else
+		{
+			return AnyState{ std::in_place_type<StateType>, p };
+		}
+	}, param);
+}
+
+
+/*
+* ParallelState の実装
+*/
+
+ParallelState::ParallelState(PinnedParam<ParallelParam> param)
+	: m_param{ param.param }
+	, m_pin{ std::move(param.pin) }
+{
+}
+
+void ParallelState::save(ScenarioBinary::Encoder& encoder) const
+{
+	WriteParamRef(encoder, m_param);
+	encoder.write<uint32>(static_cast<uint32>(m_tracks.size()));
+	for (const auto& track : m_tracks)
+	{
+		track.save(encoder);
+	}
+}
+
+ParallelState::ParallelState(ScenarioBinary::Decoder& decoder, EntitySet& entities)
+	: ParallelState{ ReadParamRef<ParallelParam>(decoder) }
+{
+	const uint32 trackCount = decoder.readCount(sizeof(uint32));
+	m_tracks.reserve(trackCount);
+	for (uint32 i = 0; i < trackCount; ++i)
+	{
+		m_tracks.emplace_back(decoder, entities);
+	}
+}
+
+void ParallelState::onAfterPush(EntitySet& entities)
+{
+	m_tracks.reserve(m_param.tracks.size());
+	for (const auto& track : m_param.tracks)
+	{
+		m_tracks.emplace_back(entities, track, m_pin);
+	}
+}
+
+State::Action ParallelState::update(EntitySet& entities)
+{
+	// 全てのトラックを1フレームずつ進める
+	// 歩行などの補間は updateSystems でまとめて行われるので、ここでは各トラックの top を進めるだけ
+	for (auto& track : m_tracks)
+	{
+		track.update(entities);
+	}
+
+	m_tracks.remove_if([](const StateStack& track) { return track.isEmpty(); });
+	if (m_tracks.empty()) { return Action::Pop(); }
+
+	// 全てのトラックが眠っていれば、どれかが起きるまで眠る
+	StateStack::WakeCondition wake{ {}, Math::Inf };
+	for (const auto& track : m_tracks)
+	{
+		const auto trackWake = track.wakeCondition();
+		if (not trackWake) { return Action::None(); }
+		wake.actions |= trackWake->actions;
+		wake.time = Min(wake.time, trackWake->time);
+	}
+	return Action::Sleep(wake.actions, wake.time);
+}
+
+void ParallelState::onBeforePop(EntitySet& entities)
+{
+	for (auto& track : m_tracks)
+	{
+		track.clear(entities);
+	}
+}
+
+
+/*
+* TransitionLog の実装
+*/
+
+void TransitionLog::openFile(FilePathView path)
+{
+	stop();
+	m_isFileOpen = m_file.open(path);
+	start();
+}
+
+void TransitionLog::handleInput()
+{
+	if (not KeyF3.down()) { return; }
+
+	stop();
+	m_isViewVisible = not m_isViewVisible;
+	{
+		std::lock_guard lock{ m_viewMutex };
+		m_viewLines.clear();
+	}
+	start();
+}
+
+void TransitionLog::drawView() const
+{
+	if (not m_isViewVisible) { return; }
+
+	Array<String> lines;
+	{
+		std::lock_guard lock{ m_viewMutex };
+		lines = m_viewLines;
+	}
+
+	Vec2 pos{ Scene::Width() - 200.0, 8.0 };
+	for (const auto& line : lines)
+	{
+		m_font(line).draw(pos, Palette::White);
+		pos.y += 15;
+	}
+
+	if (const uint64 dropped = m_droppedCount.load(std::memory_order_relaxed))
+	{
+		m_font(U"dropped {}"_fmt(dropped)).draw(pos, Palette::Orange);
+	}
+}
+
+void TransitionLog::start()
+{
+	if (not (m_isFileOpen || m_isViewVisible)) { return; }
+
+	m_isEnabled.store(true, std::memory_order_relaxed);
+	m_consumer = std::thread{ [this] { consume(); } };
+}
+
+void TransitionLog::stop()
+{
+	if (not m_consumer.joinable()) { return; }
+
+	m_isEnabled.store(false, std::memory_order_relaxed);
+	m_consumer.join(); // 残っているものは consume が書き出してから終わる
+}
+
+void TransitionLog::consume()
+{
+	for (;;)
+	{
+		const bool isLast = not isEnabled(); // 無効になった後に一度だけ残りを片付ける
+		const size_t head = m_head.load(std::memory_order_acquire);
+		size_t tail = m_tail.load(std::memory_order_relaxed);
+
+		for (; tail != head; ++tail)
+		{
+			const String line = Format(m_events[tail % Capacity]);
+			if (m_isFileOpen)
+			{
+				m_file.writeln(line);
+			}
+			if (m_isViewVisible)
+			{
+				std::lock_guard lock{ m_viewMutex };
+				if (MaxViewLines <= m_viewLines.size())
+				{
+					m_viewLines.pop_front();
+				}
+				m_viewLines.push_back(line);
+			}
+		}
+		m_tail.store(tail, std::memory_order_release);
+
+		if (isLast) { return; }
+		std::this_thread::sleep_for(std::chrono::milliseconds{ 5 });
+	}
+}
+
+String TransitionLog::Format(const Event& event)
+{
+	String line = U"{:>6} "_fmt(event.frame);
+	for (uint16 _ = 0; _ < event.depth; ++_)
+	{
+		line += U"┃";
+	}
+
+	if (event.type == Event::Type::POP)
+	{
+		return line + U"┗";
+	}
+
+	line += U"┏";
+	line += States::TypeNames[event.stateType];
+	if (not event.scenario.isEmpty())
+	{
+		line += U"[[" + GetSymbolTable().name(event.scenario) + U"]]";
+	}
+	return line;
+}
+
+
+/*
+* SaveData
+*/
+
+// F5 で保存・F9 で読み込み（--load-state=path で起動時に読み込む）
+// 形式は ScenarioBinary と同じで、scenarios/ のファイルのハッシュ・EntitySet・StateStack の順に書く
+// State が参照しているパラメータはシナリオ名とコマンドの番号で書くので、scenario.toml・scenarios/ のファイルが変わっていたら読み込まない
+
+void TweenTable::save(ScenarioBinary::Encoder& encoder) const
+{
+	for (const auto& t : m_tracks)
+	{
+		encoder.writeArray(t.index.entities());
+		encoder.writeArray(t.from);
+		encoder.writeArray(t.to);
+		encoder.writeArray(t.elapsed);
+		encoder.writeArray(t.duration);
+		encoder.writeArray(t.easing);
+	}
+}
+
+void TweenTable::load(ScenarioBinary::Decoder& decoder)
+{
+	for (auto& t : m_tracks)
+	{
+		const auto entities = decoder.readArray<Entity>();
+		t.from = decoder.readArray<double>();
+		t.to = decoder.readArray<double>();
+		t.elapsed = decoder.readArray<double>();
+		t.duration = decoder.readArray<double>();
+		t.easing = decoder.readArray<Easing>();
+		if (t.from.size() != entities.size() || t.to.size() != entities.size()
+			|| t.elapsed.size() != entities.size() || t.duration.size() != entities.size()
+			|| t.easing.size() != entities.size()
+			|| t.easing.any([](Easing easing) { return Easing::EASE_IN_OUT < easing; }))
+		{
+			throw std::runtime_error{ "SaveData: bad tween table" };
+		}
+
+		t.index = SparseSet{};
+		for (const auto& entity : entities)
+		{
+			// 同じ Entity が2つあると from などの配列と番号がずれる
+			if (t.index.contains(entity)) { throw std::runtime_error{ "SaveData: duplicate tween entity" }; }
+			t.index.add(entity);
+		}
+		t.value.assign(entities.size(), 0.0); // 次の update で計算し直す
+	}
+}
+
+void EntitySet::save(ScenarioBinary::Encoder& encoder) const
+{
+	encoder.writeArray(m_generations);
+	encoder.writeArray(m_freeIndices);
+
+	encoder.write<uint32>(static_cast<uint32>(nameTable.size()));
+	for (const auto& [name, entity] : nameTable)
+	{
+		encoder.writeString(name);
+		encoder.write(entity);
+	}
+
+	// 前の tick の座標は保存しない（読み込んだ直後は今の座標と同じ）
+	encoder.writeArray(posTable.entities());
+	encoder.writeArray(posTable.xs());
+	encoder.writeArray(posTable.ys());
+	encoder.writeArray(posTable.zs());
+
+	// テクスチャ・フォントは作り方だけ書いて、読み込むときに AssetCache から取り直す
+	encoder.writeArray(imageTable.entities());
+	for (const auto& imageC : imageTable.components())
+	{
+		encoder.writeString(imageC.sheet->texture->path);
+		encoder.write(imageC.sheet->cellSize.x);
+		encoder.write(imageC.sheet->cellSize.y);
+		encoder.write(imageC.imagePos.x);
+		encoder.write(imageC.imagePos.y);
+		encoder.write<uint8>(imageC.isHidden);
+		encoder.write(imageC.alpha);
+		encoder.write(imageC.scale);
+	}
+
+	encoder.writeArray(textTable.entities());
+	for (const auto& textC : textTable.components())
+	{
+		encoder.writeString(textC.text);
+		encoder.write(textC.font->size);
+		encoder.write<uint8>(static_cast<uint8>(textC.font->typeface));
+	}
+
+	// 同じ EntityDesc から作ったものはクリップを共有しているので、クリップは1回だけ書く
+	HashTable<const AnimationClip*, uint32> clipIndices;
+	Array<const AnimationClip*> clips;
+	for (const auto& animationC : animationTable.components())
+	{
+		if (clipIndices.emplace(animationC.clip.get(), static_cast<uint32>(clips.size())).second)
+		{
+			clips.push_back(animationC.clip.get());
+		}
+	}
+	encoder.write<uint32>(static_cast<uint32>(clips.size()));
+	for (const auto* clip : clips)
+	{
+		encoder.writeClip(*clip);
+	}
+	encoder.writeArray(animationTable.entities());
+	for (const auto& animationC : animationTable.components())
+	{
+		encoder.write<uint32>(clipIndices.at(animationC.clip.get()));
+		encoder.write(animationC.elapsed);
+	}
+
+	tweenTable.save(encoder);
+}
+
+// 空の EntitySet に読み込む
+void EntitySet::load(ScenarioBinary::Decoder& decoder)
+{
+	m_generations = decoder.readArray<uint32>();
+	m_freeIndices = decoder.readArray<uint32>();
+
+	const auto readEntities = [&] {
+		auto entities = decoder.readArray<Entity>();
+		for (const auto& entity : entities)
+		{
+			if (not isAlive(entity)) { throw std::runtime_error{ "SaveData: bad entity" }; }
+		}
+		return entities;
+	};
+
+	m_names.assign(m_generations.size(), Symbol{});
+	m_nameTexts.assign(m_generations.size(), &GetSymbolTable().name(Symbol{}));
+	const uint32 nameCount = decoder.read<uint32>();
+	for (uint32 i = 0; i < nameCount; ++i)
+	{
+		const Symbol name = decoder.readSymbol();
+		const Entity entity = decoder.read<Entity>();
+		if (not isAlive(entity)) { throw std::runtime_error{ "SaveData: bad entity" }; }
+		nameTable.emplace(name, entity);
+		m_names[entity.index] = name;
+		m_nameTexts[entity.index] = &GetSymbolTable().name(name);
+	}
+
+	{
+		const auto posEntities = readEntities();
+		const auto xs = decoder.readArray<double>();
+		const auto ys = decoder.readArray<double>();
+		const auto zs = decoder.readArray<double>();
+		if (xs.size() != posEntities.size() || ys.size() != posEntities.size() || zs.size() != posEntities.size())
+		{
+			throw std::runtime_error{ "SaveData: bad pos table" };
+		}
+		for (size_t i = 0; i < posEntities.size(); ++i)
+		{
+			posTable.insert(posEntities[i], { Vec3{ xs[i], ys[i], zs[i] } });
+		}
+	}
+
+	for (const auto& entity : readEntities())
+	{
+		const String path{ decoder.readString() };
+		const Size cellSize{ decoder.read<int32>(), decoder.read<int32>() };
+		const Point imagePos{ decoder.read<int32>(), decoder.read<int32>() };
+		const bool isHidden = (decoder.read<uint8>() != 0);
+		const double alpha = decoder.read<double>();
+		const double scale = decoder.read<double>();
+		imageTable.insert(entity, { GetAssetCache().sheet(path, cellSize), imagePos, isHidden, alpha, scale });
+	}
+
+	for (const auto& entity : readEntities())
+	{
+		const String text{ decoder.readString() };
+		const int32 fontSize = decoder.read<int32>();
+		const auto typeface = static_cast<Typeface>(decoder.read<uint8>());
+		textTable.insert(entity, TextComponent::Make(text, GetAssetCache().font(fontSize, typeface)));
+	}
+
+	Array<std::shared_ptr<const AnimationClip>> clips(decoder.readCount(sizeof(uint32)));
+	for (auto& clip : clips)
+	{
+		clip = decoder.readClip();
+	}
+	for (const auto& entity : readEntities())
+	{
+		const uint32 clipIndex = decoder.read<uint32>();
+		if (clips.size() <= clipIndex) { throw std::runtime_error{ "SaveData: bad animation" }; }
+		animationTable.insert(entity, { clips[clipIndex], decoder.read<double>() });
+	}
+
+	tweenTable.load(decoder);
+	for (size_t p = 0; p < TweenPropertyCount; ++p)
+	{
+		for (const auto& entity : tweenTable.entities(static_cast<TweenProperty>(p)))
+		{
+			if (not isAlive(entity)) { throw std::runtime_error{ "SaveData: bad entity" }; }
+		}
+	}
+}
+
+namespace SaveData
+{
+	constexpr uint32 Magic = 0x45564153; // "SAVE"
+	constexpr uint32 Version = 5;
+	constexpr StringView DefaultPath = U"savestate.bin";
+
+	// scenarios/ の .toml ごとのファイル名（拡張子なし）と中身のハッシュ
+	inline Array<std::pair<String, uint64>> HashScenarioFiles()
+	{
+		Array<std::pair<String, uint64>> hashes;
+		for (const auto& path : FileSystem::DirectoryContents(ScenarioLibrary::ScenarioDirectory, Recursive::No))
+		{
+			if (FileSystem::Extension(path) != U"toml") { continue; }
+			hashes.emplace_back(FileSystem::BaseName(path), ScenarioBinary::HashFile(path));
+		}
+		return hashes;
+	}
+
+	// 書き出せなかった場合は false
+	inline bool Save(FilePathView path, const EntitySet& entities, const StateStack& stateStack)
+	{
+		try
+		{
+			ScenarioBinary::Encoder encoder;
+			const auto fileHashes = HashScenarioFiles();
+			encoder.write<uint32>(static_cast<uint32>(fileHashes.size()));
+			for (const auto& [fileName, hash] : fileHashes)
+			{
+				encoder.writeString(fileName);
+				encoder.write<uint64>(hash);
+			}
+			entities.save(encoder);
+			stateStack.save(encoder);
+			return encoder.save(path, ScenarioBinary::HashFile(ScenarioTOMLPath), 0, Magic, Version);
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+	}
+
+	// scenario.toml・scenarios/ のファイルが保存したときと違う・壊れている場合は false（entities・stateStack はそのまま）
+	// 保存した後に増えた scenarios/ のファイルは参照されていないので見ない
+	// シミュレーションが止まっているときに呼ぶ
+	inline bool Load(FilePathView path, EntitySet& entities, StateStack& stateStack)
+	{
+		if (not FileSystem::IsFile(path)) { return false; }
+
+		MemoryMappedFileView file{ path };
+		if (not file) { return false; }
+		const auto mapped = file.mapAll();
+
+		try
+		{
+			ScenarioBinary::Decoder decoder{ mapped.data, mapped.size };
+			const auto header = decoder.read<ScenarioBinary::Header>();
+			const uint64 sourceHash = ScenarioBinary::HashFile(ScenarioTOMLPath);
+			if (header.magic != Magic || header.version != Version
+				|| (sourceHash != 0 && header.sourceHash != sourceHash))
+			{
+				return false;
+			}
+			decoder.readStringTable(header.stringCount);
+
+			// scenarios/ のファイルは scenario.bin に変換しないので、無くなったものも変わったとみなす
+			const uint32 fileCount = decoder.readCount(sizeof(uint32) + sizeof(uint64));
+			for (uint32 i = 0; i < fileCount; ++i)
+			{
+				const String fileName{ decoder.readString() };
+				const uint64 hash = decoder.read<uint64>();
+				if (ScenarioBinary::HashFile(FilePath{ ScenarioLibrary::ScenarioDirectory } + fileName + U".toml") != hash)
+				{
+					return false;
+				}
+			}
+
+			// 最後まで読めてから差し替える
+			EntitySet loadedEntities;
+			loadedEntities.load(decoder);
+			StateStack loadedStateStack{ decoder, loadedEntities };
+
+			entities = std::move(loadedEntities);
+			stateStack = std::move(loadedStateStack);
+			return true;
+		}
+		catch (const std::exception&)
+		{
+			return false;
+		}
+	}
+}
+
+
+/*
+* MemoryMonitor
+*/
+
+// メモリ使用量の目安を区分ごとに数えて、最大値と予算を見る
+// テクスチャ・フォントは AssetCache と TextureAtlas、シナリオは ScenarioLibrary、Component は EntitySet から数える
+class MemoryMonitor
+{
+public:
+	enum class Category : uint8
+	{
+		TEXTURE,
+		FONT,
+		SCENARIO,
+		COMPONENT,
+	};
+
+	static constexpr size_t CategoryCount = 4;
+	static constexpr uint32 SampleInterval = 15; // 何フレームごとに数え直すか
+	static constexpr StringView DefaultDumpPath = U"memory_report.txt";
+
+	// 区分ごとの予算（バイト、0: 無制限）
+	using Budgets = std::array<size_t, CategoryCount>;
+
+	// "texture:64,font:8" のように MB で書いたもの（書いていない区分は 0、読めない場合は none）
+	static Optional<Budgets> ParseBudgets(StringView text);
+
+	static StringView CategoryName(Category category);
+
+	// テクスチャ・フォントは AssetCache、シナリオは ScenarioLibrary（scenarios/ のファイル）にも渡して追い出してもらう
+	// シナリオを書いていないときのファイルの予算は DefaultFileBudgetBytes のまま、Component は追い出せないので警告だけ
+	void setBudgets(const Budgets& budgets);
+
+	// SampleInterval フレームごとに数え直し、予算を超えたときに警告する（シミュレーションの止まっている間に呼ぶ）
+	void update(const EntitySet& entities);
+
+	size_t current(Category category) const { return m_current[ToIndex(category)]; }
+	size_t peak(Category category) const { return m_peak[ToIndex(category)]; }
+
+	// F4: 内訳を DefaultDumpPath に書き出す（シミュレーションの止まっている間に呼ぶ）
+	void handleInput(const EntitySet& entities);
+
+	// 書き出せなかった場合は false
+	bool dump(FilePathView path, const EntitySet& entities);
+
+private:
+	static constexpr size_t ToIndex(Category category) { return static_cast<size_t>(category); }
+
+	static String FormatBytes(size_t bytes);
+
+	// f(区分, 名前, バイト数, isCached): 数えるもの全て（isCached: 参照されずにキャッシュに残っているだけ）
+	template<class F>
+	static void ForEachItem(const EntitySet& entities, F&& f);
+
+	void sample(const EntitySet& entities);
+
+	Budgets m_budgets{};
+	std::array<size_t, CategoryCount> m_current{};
+	std::array<size_t, CategoryCount> m_peak{};
+	std::array<bool, CategoryCount> m_isOverBudget{}; // 警告は超えたときに1回だけ出す
+	uint32 m_framesUntilSample = 0;
+};
+
+Optional<MemoryMonitor::Budgets> MemoryMonitor::ParseBudgets(StringView text)
+{
+	Budgets budgets{};
+	for (const auto& item : String{ text }.split(U','))
+	{
+		const size_t colon = item.indexOf(U':');
+		if (colon == String::npos) { return none; }
+
+		const String name = item.substr(0, colon);
+		const auto megabytes = ParseOpt<double>(item.substr(colon + 1));
+		if (not megabytes || *megabytes < 0.0) { return none; }
+
+		bool isFound = false;
+		for (size_t i = 0; i < CategoryCount; ++i)
+		{
+			if (name == CategoryName(static_cast<Category>(i)))
+			{
+				budgets[i] = static_cast<size_t>(*megabytes * 1024 * 1024);
+				isFound = true;
+			}
+		}
+		if (not isFound) { return none; }
+	}
+	return budgets;
+}
+
+StringView MemoryMonitor::CategoryName(Category category)
+{
+	switch (category)
+	{
+	case Category::TEXTURE:
+		return U"texture";
+	case Category::FONT:
+		return U"font";
+	case Category::SCENARIO:
+		return U"scenario";
+	case Category::COMPONENT:
+		return U"component";
+	}
+	return U"";
+}
+
+void MemoryMonitor::setBudgets(const Budgets& budgets)
+{
+	m_budgets = budgets;
+	GetAssetCache().setBudgets(budgets[ToIndex(Category::TEXTURE)], budgets[ToIndex(Category::FONT)]);
+	GetScenarioLibrary().setFileBudget(budgets[ToIndex(Category::SCENARIO)]
+		? budgets[ToIndex(Category::SCENARIO)] : ScenarioLibrary::DefaultFileBudgetBytes);
+	m_isOverBudget.fill(false);
+	m_framesUntilSample = 0;
+}
+
+void MemoryMonitor::update(const EntitySet& entities)
+{
+	if (m_framesUntilSample != 0)
+	{
+		--m_framesUntilSample;
+		return;
+	}
+	m_framesUntilSample = SampleInterval - 1;
+
+	sample(entities);
+
+	for (size_t i = 0; i < CategoryCount; ++i)
+	{
+		const bool isOver = (m_budgets[i] != 0) && (m_budgets[i] < m_current[i]);
+		if (isOver && (not m_isOverBudget[i]))
+		{
+			Print << U"memory: {} が予算を超えています ({} / {})"_fmt(
+				CategoryName(static_cast<Category>(i)), FormatBytes(m_current[i]), FormatBytes(m_budgets[i]));
+		}
+		m_isOverBudget[i] = isOver;
+	}
+}
+
+void MemoryMonitor::handleInput(const EntitySet& entities)
+{
+	if (not KeyF4.down()) { return; }
+
+	Print << (dump(DefaultDumpPath, entities)
+		? U"{}: 書き出しました"_fmt(DefaultDumpPath)
+		: U"{}: 書き出しに失敗しました"_fmt(DefaultDumpPath));
+}
+
+bool MemoryMonitor::dump(FilePathView path, const EntitySet& entities)
+{
+	sample(entities);
+
+	struct Item
+	{
+		String name;
+		size_t bytes;
+		bool isCached;
+	};
+	std::array<Array<Item>, CategoryCount> items;
+	ForEachItem(entities, [&](Category category, StringView name, size_t bytes, bool isCached) {
+		items[ToIndex(category)].push_back({ String{ name }, bytes, isCached });
+	});
+
+	TextWriter writer{ path };
+	if (not writer) { return false; }
+
+	writer.writeln(U"category\tcurrent\tpeak\tbudget");
+	for (size_t i = 0; i < CategoryCount; ++i)
+	{
+		writer.writeln(U"{}\t{}\t{}\t{}"_fmt(CategoryName(static_cast<Category>(i)),
+			FormatBytes(m_current[i]), FormatBytes(m_peak[i]), m_budgets[i] ? FormatBytes(m_budgets[i]) : U"-"));
+	}
+
+	// 区分ごとに大きい順
+	for (size_t i = 0; i < CategoryCount; ++i)
+	{
+		std::stable_sort(items[i].begin(), items[i].end(),
+			[](const Item& a, const Item& b) { return a.bytes > b.bytes; });
+
+		writer.writeln(U"");
+		writer.writeln(U"[{}]"_fmt(CategoryName(static_cast<Category>(i))));
+		for (const auto& item : items[i])
+		{
+			writer.writeln(U"{}\t{}{}"_fmt(FormatBytes(item.bytes), item.name, item.isCached ? U" (cached)" : U""));
+		}
+	}
+	return true;
+}
+
+String MemoryMonitor::FormatBytes(size_t bytes)
+{
+	if (bytes < 1024 * 1024)
+	{
+		return U"{:.1f} KB"_fmt(bytes / 1024.0);
+	}
+	return U"{:.2f} MB"_fmt(bytes / (1024.0 * 1024.0));
+}
+
+template<class F>
+void MemoryMonitor::ForEachItem(const EntitySet& entities, F&& f)
+{
+	// アトラスに入っている画像はページの方で数える
+	f(Category::TEXTURE, U"(atlas)", GetTextureAtlas().byteSize(), false);
+	GetAssetCache().forEachTexture([&](const CachedTexture& texture, bool isUsed) {
+		if (texture.byteSize != 0) { f(Category::TEXTURE, texture.path, texture.byteSize, not isUsed); }
+	});
+
+	GetAssetCache().forEachFont([&](const CachedFont& font, bool isUsed) {
+		f(Category::FONT, U"{}px"_fmt(font.size), font.byteSize(), not isUsed);
+	});
+
+	GetScenarioLibrary().forEachMemoryUse([&](const String& name, size_t bytes, bool isFile) {
+		f(Category::SCENARIO, isFile ? U"{}{}.toml"_fmt(ScenarioLibrary::ScenarioDirectory, name) : name, bytes, false);
+	});
+
+	entities.forEachMemoryUse([&](StringView name, size_t bytes) {
+		f(Category::COMPONENT, name, bytes, false);
+	});
+}
+
+void MemoryMonitor::sample(const EntitySet& entities)
+{
+	m_current.fill(0);
+	ForEachItem(entities, [&](Category category, StringView, size_t bytes, bool) {
+		m_current[ToIndex(category)] += bytes;
+	});
+	for (size_t i = 0; i < CategoryCount; ++i)
+	{
+		m_peak[i] = Max(m_peak[i], m_current[i]);
+	}
+}
+
+
+/*
+* 描画
+*/
+
+// 描画に使う Component の写し
+// シミュレーション (EntitySet) をワーカースレッドで進めている間、メインスレッドはこちらを描画する
+struct RenderSnapshot
+{
+	struct Sprite
+	{
+		Vec2 prevPos; // 前の tick の位置
+		Vec2 pos;
+		std::shared_ptr<const CachedTexture> texture; // 画像なし・非表示のときは nullptr
+		Rect imageRect; // texture 内の範囲
+		double imageAlpha = 1.0;
+		double imageScale = 1.0;
+		std::shared_ptr<const TextComponent::Layout> text; // テキストなしのときは nullptr
+
+		// 止まっているときの見た目が同じか（prevPos は見ない）
+		bool looksSameAs(const Sprite& other) const
+		{
+			return pos == other.pos
+				&& texture == other.texture && imageRect == other.imageRect
+				&& imageAlpha == other.imageAlpha && imageScale == other.imageScale
+				&& text == other.text;
+		}
+	};
+
+	// z がこれ以下の Entity は背景のレイヤー
+	// 背景はまとめて RenderTexture に描いておき、中身が変わったときだけ描き直す
+	static constexpr double BackgroundMaxZ = -0.5;
+
+	Array<Sprite> sprites; // 描画順
+	size_t backgroundCount = 0; // sprites の先頭から何個が背景のレイヤーか
+	uint64 backgroundVersion = 0; // 背景のレイヤーの中身が変わるたびに増える
+	bool isBackgroundMoving = false; // 背景のレイヤーに前の tick から動いたものがある
+	size_t entityCount = 0;
+	double alpha = 0.0; // 前の tick から今の tick までのどこを描くか（FixedTimestep::alpha）
+};
+
+// Sprite1つ描画
+// viewRect の外に出ているものは描画しない
+void drawSprite(const RenderSnapshot::Sprite& sprite, const RectF& viewRect, double alpha)
+{
+	const Vec2 pos = sprite.prevPos + (sprite.pos - sprite.prevPos) * alpha;
+
+	// 画像の表示
+	if (sprite.texture && (not sprite.texture->texture.isEmpty())
+		&& RectF{ Arg::center(pos), sprite.imageRect.size * sprite.imageScale }.intersects(viewRect))
+	{
+		sprite.texture->texture(sprite.imageRect).scaled(sprite.imageScale).drawAt(pos, ColorF{ 1.0, sprite.imageAlpha });
+	}
+
+	// テキストの表示
+	if (sprite.text && RectF{ Arg::center(pos), sprite.text->size }.intersects(viewRect))
+	{
+		TextComponent::DrawAt(sprite.text->glyphs, pos, Palette::Black);
+	}
+}
+
+// 背景のレイヤーを描いておいた RenderTexture
+// メインスレッドで持ち、snapshot の backgroundVersion が変わったときだけ描き直す
+class BackgroundLayer
+{
+public:
+	// snapshot の背景のレイヤーを描画
+	void draw(const RenderSnapshot& snapshot, const RectF& viewRect);
+
+private:
+	RenderTexture m_texture;
+	uint64 m_version = 0;
+	bool m_isValid = false;
+};
+
+void BackgroundLayer::draw(const RenderSnapshot& snapshot, const RectF& viewRect)
+{
+	// 動いている間は毎フレーム描き直すことになるので、そのまま補間して描く
+	if (snapshot.isBackgroundMoving)
+	{
+		for (size_t i = 0; i < snapshot.backgroundCount; ++i)
+		{
+			drawSprite(snapshot.sprites[i], viewRect, snapshot.alpha);
+		}
+		m_isValid = false;
+		return;
+	}
+
+	if (m_texture.size() != Scene::Size())
+	{
+		m_texture = RenderTexture{ Scene::Size() };
+		m_isValid = false;
+	}
+
+	if ((not m_isValid) || m_version != snapshot.backgroundVersion)
+	{
+		static const uint32 cacheZone = GetFrameProfiler().zone(U"Renderer::background");
+		ProfileScope scope{ cacheZone };
+
+		// 一番下のレイヤーなので、背景色で塗りつぶして不透明なまま重ねる
+		const ScopedRenderTarget2D target{ m_texture.clear(Scene::GetBackground()) };
+		for (size_t i = 0; i < snapshot.backgroundCount; ++i)
+		{
+			drawSprite(snapshot.sprites[i], viewRect, 1.0);
+		}
+		m_version = snapshot.backgroundVersion;
+		m_isValid = true;
+	}
+
+	m_texture.draw();
+}
+
+// snapshot をまとめて描画
+// viewRect: 画面（カメラ）の範囲
+// 背景のレイヤーは background に描いておいたものを使い、その上に残りを毎フレーム描く
+void drawSnapshot(const RenderSnapshot& snapshot, const RectF& viewRect, BackgroundLayer& background)
+{
+	static const uint32 drawZone = GetFrameProfiler().zone(U"Renderer::draw");
+	ProfileScope scope{ drawZone };
+	background.draw(snapshot, viewRect);
+	for (size_t i = snapshot.backgroundCount; i < snapshot.sprites.size(); ++i)
 	{
-		entities.erase(name);
+		drawSprite(snapshot.sprites[i], viewRect, snapshot.alpha);
 	}
 }
 
-void ScenarioState::makeEntities(EntitySet& entities, const TOMLValue& params)
+// EntitySet を描画順に RenderSnapshot に写す
+// 同じ z の中では同じテクスチャの画像が連続するように並べ、
+// 連続した同じテクスチャの描画を1回の描画コールにまとめてもらう
+// テキストのみの Entity はその後ろにフォントごとに並べ、文字の描画もまとめてもらう
+// 背景のレイヤーは前に写したものと比べて、変わったときだけ backgroundVersion を増やす
+class Renderer
 {
-	for (const auto& param : params.tableArrayView())
+public:
+	// シミュレーションと同じスレッドで呼ぶ
+	// 前の tick と今の位置のどちらでも viewRect の外にあるものは写さない
+	void capture(const EntitySet& entities, RenderSnapshot& snapshot, double alpha, const RectF& viewRect);
+
+private:
+	// z の同じ範囲をテクスチャごとに並べ替える
+	void rebuild(const EntitySet& entities);
+
+	Array<Entity> m_order;
+	Array<std::pair<uint64, Entity>> m_band; // 並べ替え用の作業領域
+	Array<RenderSnapshot::Sprite> m_background; // 前に写した背景のレイヤー
+	uint64 m_backgroundVersion = 0;
+
+	uint64 m_posVersion = 0;
+	uint64 m_imageVersion = 0;
+	uint64 m_textVersion = 0;
+};
+
+void Renderer::capture(const EntitySet& entities, RenderSnapshot& snapshot, double alpha, const RectF& viewRect)
+{
+	entities.drawOrder(); // 必要ならここで z 順が並べ直される
+
+	// z 順もテクスチャも変わっていなければ並べ直さない
+	if (m_posVersion != entities.posTable.drawOrderVersion()
+		|| m_imageVersion != entities.imageTable.version()
+		|| m_textVersion != entities.textTable.version())
 	{
-		const String name = param[U"name"].getString();
-		entities.nameSet.insert(name);
-		m_nameSetMadeOnThis.insert(name);
+		static const uint32 sortZone = GetFrameProfiler().zone(U"Renderer::rebuild");
+		ProfileScope scope{ sortZone };
+		rebuild(entities);
+	}
 
-		if (param[U"pos"].isTable())
+	snapshot.sprites.clear(); // 容量は使いまわす
+	snapshot.backgroundCount = 0;
+	snapshot.isBackgroundMoving = false;
+	snapshot.entityCount = entities.size();
+	snapshot.alpha = alpha;
+	for (const auto& entity : m_order)
+	{
+		if (not entities.posTable.contains(entity)) { continue; }
+
+		const Vec3 pos = entities.posTable.at(entity).pos;
+		RenderSnapshot::Sprite sprite{ entities.posTable.previous(entity), pos.xy() };
+		const auto isVisible = [&](const auto& component) {
+			return component.bounds(sprite.prevPos).intersects(viewRect) || component.bounds(sprite.pos).intersects(viewRect);
+		};
+
+		if (entities.imageTable.contains(entity))
 		{
-			TOMLValue pos = param[U"pos"];
-			entities.posTable[name] = {
-				Vec3{
-					pos[U"x"].get<double>(),
-					pos[U"y"].get<double>(),
-					pos[U"z"].get<double>(),
-				}
-			};
+			const auto& imageC = entities.imageTable.at(entity);
+			if (not imageC.isHidden && 0.0 < imageC.alpha && isVisible(imageC))
+			{
+				sprite.texture = imageC.sheet->texture;
+				sprite.imageRect = imageC.sheet->cell(imageC.imagePos);
+				sprite.imageAlpha = imageC.alpha;
+				sprite.imageScale = imageC.scale;
+			}
 		}
-
-		if (param[U"image"].isTable())
+		if (entities.textTable.contains(entity))
 		{
-			TOMLValue image = param[U"image"];
-			entities.imageTable[name] = {
-				Texture{ image[U"path"].getString() },
-				Size{
-					image[U"size.x"].get<int32>(),
-					image[U"size.y"].get<int32>(),
-				},
-				Point{
-					image[U"pos.x"].get<int32>(),
-					image[U"pos.y"].get<int32>(),
-				},
-				image[U"isHidden"].getOr<bool>(false),
-			};
+			if (const auto& textC = entities.textTable.at(entity); isVisible(textC))
+			{
+				sprite.text = textC.layout;
+			}
 		}
-
-		if (param[U"text"].isTable())
+		if (sprite.texture || sprite.text)
 		{
-			TOMLValue text = param[U"text"];
-			entities.textTable[name] = {
-				text[U"text"].getString(),
-				Font{ text[U"font.size"].get<int32>() },
-			};
+			// z 順に並んでいるので、背景のレイヤーは先頭に集まる
+			if (pos.z <= RenderSnapshot::BackgroundMaxZ)
+			{
+				++snapshot.backgroundCount;
+				snapshot.isBackgroundMoving |= (sprite.prevPos != sprite.pos);
+			}
+			snapshot.sprites.push_back(std::move(sprite));
 		}
 	}
-}
 
-// AdventureState::updateの実装
-State::Action AdventureState::update(EntitySet& entities)
-{
-	auto& posC = entities.posTable.at(m_entityName);
-	auto& imageC = entities.imageTable.at(m_entityName);
-	if (KeyLeft.pressed())
-	{
-		posC.pos.x -= 100.0 * Scene::DeltaTime();
-		imageC.imagePos.x = 1;
-	}
-	else if (KeyRight.pressed())
+	// 背景のレイヤーが前と同じなら、描いておいたものをそのまま使ってもらう
+	const auto backgroundEnd = snapshot.sprites.begin() + snapshot.backgroundCount;
+	if (not std::equal(snapshot.sprites.begin(), backgroundEnd, m_background.begin(), m_background.end(),
+		[](const auto& a, const auto& b) { return a.looksSameAs(b); }))
 	{
-		posC.pos.x += 100.0 * Scene::DeltaTime();
-		imageC.imagePos.x = 2;
+		m_background.assign(snapshot.sprites.begin(), backgroundEnd);
+		++m_backgroundVersion;
 	}
-	posC.pos.x = Clamp(posC.pos.x, 0.0, 640.0);
+	snapshot.backgroundVersion = m_backgroundVersion;
+}
 
+void Renderer::rebuild(const EntitySet& entities)
+{
+	const auto& drawOrder = entities.drawOrder();
+	m_order.clear();
 
-	for (const auto& [targetName, scenarioName] : m_link)
+	for (size_t begin = 0; begin < drawOrder.size();)
 	{
-		const auto& targetPosC = entities.posTable.at(targetName);
-		if (Abs(posC.pos.x - targetPosC.pos.x) < 60.0 && KeySpace.down())
+		const double z = entities.posTable.at(drawOrder[begin]).pos.z;
+
+		m_band.clear();
+		size_t end = begin;
+		for (; end < drawOrder.size() && entities.posTable.at(drawOrder[end]).pos.z == z; ++end)
 		{
-			return Action::Push(
-				std::make_unique<ScenarioState>(scenarioName)
-			);
+			const Entity entity = drawOrder[end];
+			uint64 key = std::numeric_limits<uint64>::max(); // どちらも無いものは最後
+			if (entities.imageTable.contains(entity))
+			{
+				key = entities.imageTable.at(entity).sheet->texture->batchKey;
+			}
+			else if (entities.textTable.contains(entity))
+			{
+				// テキストのみは画像の後ろに、同じフォント（大きさと書体）が連続するように
+				const CachedFont& font = *entities.textTable.at(entity).font;
+				key = (uint64{ 1 } << 63) | (static_cast<uint64>(static_cast<uint32>(font.size)) << 8) | static_cast<uint64>(font.typeface);
+			}
+			m_band.emplace_back(key, entity);
 		}
+		std::stable_sort(m_band.begin(), m_band.end(),
+			[](const auto& a, const auto& b) { return a.first < b.first; });
+
+		for (const auto& [key, entity] : m_band)
+		{
+			m_order.push_back(entity);
+		}
+		begin = end;
 	}
 
-	return Action::None();
+	m_posVersion = entities.posTable.drawOrderVersion();
+	m_imageVersion = entities.imageTable.version();
+	m_textVersion = entities.textTable.version();
 }
 
 
 /*
-* StateStack
+* Simulation
 */
 
-class StateStack
+// 描画のフレームとは別に、決まった間隔 (tick) でシミュレーションを進める
+// 画面のリフレッシュレートによらず同じ結果になり、描画は tick の間を補間する
+class FixedTimestep
 {
 public:
-	StateStack();
-	void update(EntitySet& entities);
+	static constexpr double DefaultTickRate = 60.0;
+	static constexpr double MaxTickRate = 1000.0;
 
-private:
-	void pop(EntitySet& entities);
-	void push(EntitySet& entities, std::unique_ptr<State>&& nextState);
+	// 0 より大きく MaxTickRate 以下なら使える（0 では tick が進まず、負では時間が戻る）
+	static bool IsValidTickRate(double tickRate) { return (0.0 < tickRate) && (tickRate <= MaxTickRate); }
 
-	// top以外のデータも見たいのでArrayで実装
-	// 末尾以外のデータを編集しないように気を付ける
-	Array<std::unique_ptr<State>> m_stack;
+	// 1フレームで進める tick の上限（遅れすぎた分は捨てて、追いつこうとして更に重くなるのを防ぐ）
+	static constexpr int32 MaxTicksPerFrame = 8;
+
+	explicit FixedTimestep(double tickRate = DefaultTickRate)
+		: m_step{ 1.0 / tickRate }
+	{
+	}
+
+	// フレームの経過時間を足して、このフレームで進める tick の数を返す
+	int32 advance(double deltaTime)
+	{
+		m_accumulator = Min(m_accumulator + deltaTime, m_step * MaxTicksPerFrame);
+		const int32 ticks = static_cast<int32>(m_accumulator / m_step);
+		m_accumulator -= ticks * m_step;
+		return ticks;
+	}
+
+	// 1 tick の秒数
+	double step() const { return m_step; }
+
+	// 最後の tick から次の tick までのどこにいるか [0, 1)
+	double alpha() const { return m_accumulator / m_step; }
+
+private:
+	double m_step;
+	double m_accumulator = 0.0;
 };
 
-StateStack::StateStack()
+// シミュレーションを1 tick 進める
+void tickSimulation(EntitySet& entities, StateStack& stateStack, const FrameInput& input)
 {
-	m_stack.push_back(std::make_unique<ScenarioState>(U"init"));
-	Print << U"┏ScenarioState[[init]]";
+	const double time = GetFrameInput().time + input.deltaTime;
+	GetFrameInput() = input;
+	GetFrameInput().time = time;
+	entities.posTable.storePrevious();
+	updateSystems(entities, input.deltaTime);
+	stateStack.update(entities);
 }
 
-void StateStack::update(EntitySet& entities)
+// true のとき、次のフレームのシミュレーションをワーカースレッドで進めている間に前のフレームの結果を描画する
+// false のときはメインスレッドで順に行う
+constexpr bool UsePipelinedSimulation = true;
+
+// フレームごとに tick を進めて RenderSnapshot に写す
+// snapshot は2つあり、ワーカーが back に書いている間メインスレッドは front を描画する
+// 描画は1フレーム遅れるが、更新と描画が重なる
+class SimulationPipeline
 {
-	if (m_stack.empty()) { return; }
+public:
+	SimulationPipeline(EntitySet& entities, StateStack& stateStack, double tickRate);
+	~SimulationPipeline();
 
-	// Stateの更新して、スタック操作を取得
-	auto [type, nextState] = m_stack.back()->update(entities);
+	SimulationPipeline(const SimulationPipeline&) = delete;
+	SimulationPipeline& operator=(const SimulationPipeline&) = delete;
 
-	switch (type)
+	// 走っているシミュレーションの終了を待つ（ワーカーで起きた例外はここで投げ直す）
+	// この後 start までは EntitySet・AssetCache・ScenarioLibrary をメインスレッドから触ってよい
+	void wait();
+
+	// 結果を front に入れ替えて、input で次のフレームのシミュレーションを始める
+	// viewRect: 描画する範囲（外にあるものは RenderSnapshot に写さない）
+	void start(const FrameInput& input, const RectF& viewRect);
+
+	// 描画する結果（次の start まで変わらない）
+	const RenderSnapshot& front() const { return m_front; }
+
+	// EntitySet を差し替えたとき（SaveData::Load）に、前の EntitySet から作った描画順のキャッシュを捨てる
+	// wait と start の間に呼ぶ
+	void resetCapture()
 	{
-	case State::Action::Type::NONE:
-		break;
+		m_renderer = Renderer{};
+		m_stillFrames = 0;
+		m_idleSeconds.reset();
+	}
 
-	case State::Action::Type::POP:
-		pop(entities);
-		break;
+	// 何も動いておらず、State が全て眠っている間の次に起きるまでの秒数（Math::Inf: 入力があるまで）
+	// 動いているときは none。wait と start の間に呼ぶ
+	Optional<double> idleSeconds() const { return m_idleSeconds; }
 
-	case State::Action::Type::PUSH:
-		push(entities, std::move(nextState));
-		break;
+private:
+	// 1フレーム分の tick を進めて back に写す
+	void run(FrameInput input);
+
+	void workerLoop();
+
+	EntitySet& m_entities;
+	StateStack& m_stateStack;
+	Renderer m_renderer;
+	FixedTimestep m_timestep;
+	uint64 m_tickCount = 0;
+	InputActions m_pendingDown; // tick の無いフレームで押された操作を次の tick まで取っておく
+
+	// 続けて何も変わらなかったフレームの数
+	// front と back の両方に同じ結果が入ったら、写すのをやめる
+	int32 m_stillFrames = 0;
+	Optional<double> m_idleSeconds;
+
+	RenderSnapshot m_front;
+	RenderSnapshot m_back;
+
+	std::thread m_worker;
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	FrameInput m_input;
+	RectF m_viewRect{ 0, 0, 0, 0 };
+	RectF m_capturedViewRect{ 0, 0, 0, 0 }; // 前に写したときの範囲（変わったら止まっていても写し直す）
+	bool m_hasJob = false;
+	bool m_isQuitting = false;
+	std::exception_ptr m_error;
+};
 
-	case State::Action::Type::RESET:
-		while (not m_stack.empty()) { pop(entities); }
-		push(entities, std::move(nextState));
-		break;
+SimulationPipeline::SimulationPipeline(EntitySet& entities, StateStack& stateStack, double tickRate)
+	: m_entities{ entities }
+	, m_stateStack{ stateStack }
+	, m_timestep{ tickRate }
+{
+	if (UsePipelinedSimulation)
+	{
+		m_worker = std::thread{ [this] { workerLoop(); } };
+		GetFrameProfiler().setSimulationThread(m_worker.get_id());
 	}
 }
 
-void StateStack::pop(EntitySet& entities)
+SimulationPipeline::~SimulationPipeline()
 {
-	m_stack.back()->onBeforePop(entities);
-	m_stack.pop_back();
+	if (not m_worker.joinable()) { return; }
 
-	String debug;
-	for (int32 _=0; _ < m_stack.size(); ++_)
 	{
-		debug += U"┃";
+		std::lock_guard lock{ m_mutex };
+		m_isQuitting = true;
 	}
-	Print << debug << U"┗";
+	m_condition.notify_all();
+	m_worker.join();
+	GetFrameProfiler().setSimulationThread({});
 }
 
-void StateStack::push(EntitySet& entities, std::unique_ptr<State>&& nextState)
+void SimulationPipeline::wait()
 {
-	String debug;
-	for (int32 _=0; _ < m_stack.size(); ++_)
+	if (not UsePipelinedSimulation) { return; }
+
+	static const uint32 zone = GetFrameProfiler().zone(U"SimulationPipeline::wait");
+	ProfileScope scope{ zone };
+
+	std::unique_lock lock{ m_mutex };
+	m_condition.wait(lock, [this] { return not m_hasJob; });
+	GetFrameProfiler().collectSimulationEvents(); // 前のフレームで始めたシミュレーションの区間
+	if (m_error)
 	{
-		debug += U"┃";
+		std::rethrow_exception(std::exchange(m_error, nullptr));
 	}
-	m_stack.push_back(std::move(nextState));
-	m_stack.back()->onAfterPush(entities);
-	Print << debug + U"┏" + m_stack.back()->getName();
 }
 
+void SimulationPipeline::start(const FrameInput& input, const RectF& viewRect)
+{
+	if (not UsePipelinedSimulation)
+	{
+		m_viewRect = viewRect;
+		run(input);
+		GetAssetCache().update(); // すぐに描画するので、この tick で使い始めたテクスチャ・フォントをここで作る
+		std::swap(m_front, m_back);
+		return;
+	}
 
-/*
-* 描画
-*/
+	{
+		std::lock_guard lock{ m_mutex };
+		std::swap(m_front, m_back); // wait の後なので back には前のフレームの結果が入っている
+		m_input = input;
+		m_viewRect = viewRect;
+		m_hasJob = true;
+	}
+	m_condition.notify_all();
+}
 
-// Enity1つ描画
-void drawEntity(const EntitySet& entities, const String& name)
+void SimulationPipeline::run(FrameInput input)
 {
-	if (not entities.posTable.count(name)) { return; }
-	const auto& posC = entities.posTable.at(name);
+	static const uint32 zone = GetFrameProfiler().zone(U"SimulationPipeline::run");
+	ProfileScope scope{ zone };
 
-	// 画像の表示
-	if (entities.imageTable.count(name))
+	// State が1つも呼ばれず、補間・アニメーションも無ければ EntitySet は変わっていない
+	// 最後の tick で動いたものがあれば、その tick までの補間が終わるまでは描画が変わる
+	const bool wasMoving = m_entities.isMoving();
+	const uint64 updateCount = m_stateStack.updateCount();
+
+	m_pendingDown |= input.down;
+	for (int32 ticks = m_timestep.advance(input.deltaTime); 0 < ticks; --ticks)
+	{
+		input.deltaTime = m_timestep.step();
+		input.down = std::exchange(m_pendingDown, {});
+		input.frameCount = m_tickCount++;
+		tickSimulation(m_entities, m_stateStack, input);
+	}
+
+	const bool isStill = not wasMoving && not m_entities.isMoving() && (m_stateStack.updateCount() == updateCount)
+		&& m_entities.posTable.isSettled();
+	m_stillFrames = isStill ? (m_stillFrames + 1) : 0;
+
+	m_idleSeconds.reset();
+	if (isStill)
 	{
-		const auto& imageC = entities.imageTable.at(name);
-		if (not imageC.isHidden)
+		if (const auto wake = m_stateStack.wakeCondition())
 		{
-			imageC.texture(imageC.imagePos * imageC.imageSize, imageC.imageSize).drawAt(posC.pos.xy());
+			m_idleSeconds = wake->time - GetFrameInput().time;
 		}
 	}
 
-	// テキストの表示
-	if (entities.textTable.count(name))
+	// 描画する範囲が変わったら、止まっていても写し直す
+	if (m_viewRect != m_capturedViewRect)
+	{
+		m_stillFrames = 0;
+		m_capturedViewRect = m_viewRect;
+	}
+
+	// 止まってから2回写すと、front と back のどちらにも前の tick の位置 = 今の位置の結果が入る
+	if (m_stillFrames <= 2)
+	{
+		m_renderer.capture(m_entities, m_back, m_timestep.alpha(), m_viewRect);
+	}
+}
+
+void SimulationPipeline::workerLoop()
+{
+	std::unique_lock lock{ m_mutex };
+	while (true)
 	{
-		const auto& textC = entities.textTable.at(name);
-		textC.font(textC.text).drawAt(posC.pos.xy(), Palette::Black);
+		m_condition.wait(lock, [this] { return m_hasJob || m_isQuitting; });
+		if (m_isQuitting) { return; }
+
+		const FrameInput input = m_input;
+		lock.unlock();
+		try
+		{
+			run(input);
+		}
+		catch (...)
+		{
+			lock.lock();
+			m_error = std::current_exception();
+			m_isQuitting = true; // StateStack が途中の状態なので以降は進めない
+			m_hasJob = false;
+			m_condition.notify_all();
+			return;
+		}
+		lock.lock();
+		m_hasJob = false;
+		m_condition.notify_all();
 	}
 }
 
-// Entityまとめて描画
-void drawEntities(const EntitySet& entities)
+
+// 眠っている間（入力か時刻を待っているだけで何も変わらない間）は描画の頻度を落とす
+// 起きる時刻が近いときは、遅れないように落とさない
+class FramePacer
+{
+public:
+	static constexpr double IdleFrameRateHz = 20.0;
+	static constexpr double MinIdleSeconds = 0.25;
+
+	void update(const Optional<double>& idleSeconds)
+	{
+		const bool isIdle = idleSeconds && (MinIdleSeconds <= *idleSeconds);
+		if (isIdle == m_isIdle) { return; }
+
+		m_isIdle = isIdle;
+		Graphics::SetTargetFrameRateHz(isIdle ? Optional<double>{ IdleFrameRateHz } : Optional<double>{});
+	}
+
+	bool isIdle() const { return m_isIdle; }
+
+private:
+	bool m_isIdle = false;
+};
+
+
+/*
+* Benchmark
+*/
+
+// --benchmark: ウィンドウを更新せずに固定の deltaTime と台本の入力で StateStack を回し、
+// 更新回数/秒・1フレームの処理時間 (p50/p99)・アロケーション回数を Console に出す
+namespace Benchmark
 {
-	Array<std::pair<double, String>> drawList;
-	for (const auto& name : entities.nameSet)
+	constexpr double DeltaTime = 1.0 / 60.0;
+	constexpr size_t MaxFrames = 60 * 60 * 60;
+
+	// 台本の1ステップ（isSpaceDown はステップ最初のフレームだけ）
+	struct InputStep
+	{
+		double seconds;
+		bool isLeftPressed = false;
+		bool isRightPressed = false;
+		bool isSpaceDown = false;
+	};
+
+	struct Result
+	{
+		String name;
+		size_t frameCount = 0;
+		double seconds = 0.0; // 合計の処理時間
+		uint64 p50Ns = 0;
+		uint64 p99Ns = 0;
+		uint64 allocCount = 0; // ENABLE_PROFILER が無いときは 0
+		size_t maxEntityCount = 0;
+		bool isTruncated = false; // MaxFrames で打ち切った（数字は途中までのもの）
+	};
+
+	// 台本が終わるか、スタックが空になるまで回す。MaxFrames に達したら打ち切って isTruncated を立てる
+	Result Run(const String& name, EntitySet& entities, StateStack& stateStack, const Array<InputStep>& script)
+	{
+		Array<uint64> frameNs;
+		frameNs.reserve(MaxFrames);
+		Result result{ name };
+
+		const uint64 allocsAtBegin = FrameProfiler::AllocCount();
+		size_t step = 0;
+		double stepElapsed = 0.0;
+		bool isStepBegin = true;
+		InputActions previousPressed;
+
+		while (frameNs.size() < MaxFrames && not stateStack.isEmpty())
+		{
+			FrameInput input{ DeltaTime };
+			input.frameCount = frameNs.size();
+			if (step < script.size())
+			{
+				if (script[step].isLeftPressed) { input.pressed |= InputAction::LEFT; }
+				if (script[step].isRightPressed) { input.pressed |= InputAction::RIGHT; }
+				if (isStepBegin && script[step].isSpaceDown) { input.pressed |= InputAction::DECIDE; }
+
+				// 押し始めた tick は down にもなる（実際のキーと同じ）
+				input.down = input.pressed.without(previousPressed);
+				previousPressed = input.pressed;
+
+				isStepBegin = false;
+				stepElapsed += DeltaTime;
+				if (script[step].seconds <= stepElapsed)
+				{
+					++step;
+					stepElapsed = 0.0;
+					isStepBegin = true;
+				}
+			}
+			else if (not script.empty())
+			{
+				break; // 台本を最後まで流した
+			}
+			const uint64 begin = Time::GetNanosec();
+			GetAssetCache().update();
+			tickSimulation(entities, stateStack, input);
+			frameNs.push_back(Time::GetNanosec() - begin);
+
+			result.maxEntityCount = Max(result.maxEntityCount, entities.size());
+		}
+
+		result.isTruncated = (MaxFrames <= frameNs.size()) && (not stateStack.isEmpty()) && (step < script.size() || script.empty());
+		result.allocCount = FrameProfiler::AllocCount() - allocsAtBegin;
+		result.frameCount = frameNs.size();
+		for (const auto ns : frameNs)
+		{
+			result.seconds += ns / 1e9;
+		}
+
+		if (not frameNs.empty())
+		{
+			std::sort(frameNs.begin(), frameNs.end());
+			result.p50Ns = frameNs[frameNs.size() / 2];
+			result.p99Ns = frameNs[Min(frameNs.size() - 1, frameNs.size() * 99 / 100)];
+		}
+		return result;
+	}
+
+	void Report(const Result& result)
+	{
+		Console << U"{}: {} frames, {:.0f} updates/s, p50 {:.1f} us, p99 {:.1f} us, {} allocs ({:.1f}/frame), max {} entities"_fmt(
+			result.name,
+			result.frameCount,
+			(0.0 < result.seconds) ? (result.frameCount / result.seconds) : 0.0,
+			result.p50Ns / 1000.0,
+			result.p99Ns / 1000.0,
+			result.allocCount,
+			result.frameCount ? (static_cast<double>(result.allocCount) / result.frameCount) : 0.0,
+			result.maxEntityCount);
+
+		if (result.isTruncated)
+		{
+			Console << U"{}: TRUNCATED at {} frames before the run finished; the numbers above are partial"_fmt(result.name, MaxFrames);
+		}
+	}
+
+	// Room1 で npc に話しかけ (Talk)、ドアから Room2 へ移る (Door)
+	Array<InputStep> TalkDoorScript()
+	{
+		Array<InputStep> script;
+		script.push_back({ 2.3, false, true }); // npc の前まで歩く
+		script.push_back({ 0.1, false, false, true }); // 話しかける
+		for (int32 i = 0; i < 24; ++i)
+		{
+			script.push_back({ 0.5, false, false, true }); // 会話を送る
+		}
+		script.push_back({ 2.4, false, true }); // ドアの前まで歩く
+		script.push_back({ 0.1, false, false, true }); // ドアに入る
+		script.push_back({ 3.0 }); // Room2
+		return script;
+	}
+
+	// n 個の Entity を作り、全員を並列に歩かせる
+	// 歩くシナリオも Entity ごとに scenarios に追加し、最初に実行するシナリオ名を返す
+	String MakeEntitiesScenario(HashTable<String, CompiledScenario>& scenarios, size_t n)
+	{
+		CompiledScenario scenario{ U"bench_entities_{}"_fmt(n), {} };
+
+		ScenarioCommand make{ ScenarioCommand::Type::MAKE, {}, WaitParam{} };
+		ParallelParam walks;
+		for (size_t i = 0; i < n; ++i)
+		{
+			const Symbol name = GetSymbolTable().intern(U"e{}"_fmt(i));
+			const double x = 640.0 * i / n;
+
+			EntityDesc desc{ name };
+			desc.pos = PosComponent{ Vec3{ x, 100.0 + (i % 300), static_cast<double>(i % 8) } };
+			desc.image = EntityDesc::Image{ U"siv3Dkun.png", Size{ 80, 80 }, Point{ static_cast<int32>(i % 4), 0 }, false };
+			make.entities.push_back(std::move(desc));
+
+			CompiledScenario walk{ scenario.name + U"_" + GetSymbolTable().name(name), {} };
+			walk.commands.push_back({ ScenarioCommand::Type::PUSH, {}, WalkParam{ name, 640.0 - x, 200.0 } });
+			walks.tracks.push_back(ScenarioParam{ GetSymbolTable().intern(walk.name) });
+			scenarios.emplace(walk.name, std::move(walk));
+		}
+
+		scenario.commands.push_back(std::move(make));
+		scenario.commands.push_back({ ScenarioCommand::Type::PUSH, {}, std::move(walks) });
+		scenario.commands.push_back({ ScenarioCommand::Type::PUSH, {}, WaitParam{ 0.5 } });
+
+		const String rootName = scenario.name;
+		scenarios.emplace(rootName, std::move(scenario));
+		return rootName;
+	}
+
+	// MakeEntitiesScenario と同じ n 個の Entity を、1つの TweenState でまとめて動かす
+	String MakeTweensScenario(HashTable<String, CompiledScenario>& scenarios, size_t n)
+	{
+		CompiledScenario scenario{ U"bench_tweens_{}"_fmt(n), {} };
+
+		ScenarioCommand make{ ScenarioCommand::Type::MAKE, {}, WaitParam{} };
+		TweenParam tweens{ {}, 1.6, Easing::EASE_IN_OUT, true };
+		for (size_t i = 0; i < n; ++i)
+		{
+			const Symbol name = GetSymbolTable().intern(U"t{}"_fmt(i));
+			const double x = 640.0 * i / n;
+
+			EntityDesc desc{ name };
+			desc.pos = PosComponent{ Vec3{ x, 100.0 + (i % 300), static_cast<double>(i % 8) } };
+			desc.image = EntityDesc::Image{ U"siv3Dkun.png", Size{ 80, 80 }, Point{ static_cast<int32>(i % 4), 0 }, false };
+			make.entities.push_back(std::move(desc));
+
+			tweens.targets.push_back({ name, TweenProperty::X, 640.0 - x });
+			tweens.targets.push_back({ name, TweenProperty::ALPHA, 0.5 });
+		}
+
+		scenario.commands.push_back(std::move(make));
+		scenario.commands.push_back({ ScenarioCommand::Type::PUSH, {}, std::move(tweens) });
+		scenario.commands.push_back({ ScenarioCommand::Type::PUSH, {}, WaitParam{ 0.5 } });
+
+		const String rootName = scenario.name;
+		scenarios.emplace(rootName, std::move(scenario));
+		return rootName;
+	}
+
+	// n 個のコマンドを順に実行する
+	String MakeStepsScenario(HashTable<String, CompiledScenario>& scenarios, size_t n)
+	{
+		CompiledScenario scenario{ U"bench_steps_{}"_fmt(n), {} };
+
+		const Symbol stepper = GetSymbolTable().intern(U"stepper");
+
+		EntityDesc desc{ stepper };
+		desc.pos = PosComponent{ Vec3{ 320, 240, 0 } };
+		desc.image = EntityDesc::Image{ U"siv3Dkun.png", Size{ 80, 80 }, Point{ 0, 0 }, false };
+		scenario.commands.push_back({ ScenarioCommand::Type::MAKE, { std::move(desc) }, WaitParam{} });
+
+		for (size_t i = 0; i < n; ++i)
+		{
+			if (i % 2)
+			{
+				scenario.commands.push_back({ ScenarioCommand::Type::PUSH, {}, WaitParam{ 0.0 } });
+			}
+			else
+			{
+				const Point imagePos{ static_cast<int32>(i / 2 % 4), 0 };
+				scenario.commands.push_back({ ScenarioCommand::Type::PUSH, {}, AnimParam{ stepper, imagePos, false } });
+			}
+		}
+
+		const String rootName = scenario.name;
+		scenarios.emplace(rootName, std::move(scenario));
+		return rootName;
+	}
+
+	// 合成シナリオを1つずつ最初から最後まで流す
+	void RunSynthetic(const ScenarioLibrary& library, const Array<String>& rootNames)
 	{
-		if (entities.posTable.count(name))
+		for (const auto& name : rootNames)
 		{
-			const auto& posC = entities.posTable.at(name);
-			drawList.emplace_back(posC.pos.z, name);
+			EntitySet entities;
+			StateStack stateStack{ entities, ScenarioParam{ GetSymbolTable().intern(name), &library.slot(name) } };
+			Report(Run(name, entities, stateStack, {}));
 		}
 	}
-	std::sort(drawList.begin(), drawList.end());
 
-	for (const auto& [z, name] : drawList)
+	void RunAll()
 	{
-		drawEntity(entities, name);
+		GetTextureAtlas().finish(); // 途中でアトラスに切り替わって計測がぶれないように
+
+		{
+			EntitySet entities;
+			StateStack stateStack;
+			Report(Run(U"Talk/Door", entities, stateStack, TalkDoorScript()));
+		}
+
+		HashTable<String, CompiledScenario> scenarios;
+		Array<String> rootNames;
+		for (const size_t n : { 100, 1000, 10000 })
+		{
+			rootNames.push_back(MakeEntitiesScenario(scenarios, n));
+			rootNames.push_back(MakeTweensScenario(scenarios, n));
+		}
+		for (const size_t n : { 1000, 10000, 100000 })
+		{
+			rootNames.push_back(MakeStepsScenario(scenarios, n));
+		}
+		RunSynthetic(ScenarioLibrary{ std::move(scenarios) }, rootNames);
 	}
 }
 
@@ -683,16 +6703,130 @@ void drawEntities(const EntitySet& entities)
 
 void Main()
 {
+	// --pack-scenario: シナリオを変換して書き出すだけで終了する
+	if (System::GetCommandLineArgs().contains(U"--pack-scenario"))
+	{
+		PackScenario();
+		return;
+	}
+
+	// --trace-transitions: State の push/pop をファイルに書き出す
+	if (System::GetCommandLineArgs().contains(U"--trace-transitions"))
+	{
+		GetTransitionLog().openFile(U"transitions.log");
+	}
+
+	// --benchmark: 計測結果を出して終了する
+	if (System::GetCommandLineArgs().contains(U"--benchmark"))
+	{
+		Benchmark::RunAll();
+		return;
+	}
+
 	Window::Resize(Size{ 640, 480 });
 	Scene::SetBackground(Color{ 0x0f });
+	GetTextureAtlas(); // コマンドライン引数を読む間に、アトラスの画像を別スレッドで読み込んでおく
+
+	// --tick-rate=N: シミュレーションの更新頻度 (Hz)
+	// --load-state=path: 保存した状態から始める
+	// --memory-budget=texture:64,font:8,scenario:4,component:16 : 区分ごとのメモリの予算 (MB)
+	double tickRate = FixedTimestep::DefaultTickRate;
+	Optional<String> loadStatePath;
+	MemoryMonitor memoryMonitor;
+	for (const auto& arg : System::GetCommandLineArgs())
+	{
+		if (arg.starts_with(U"--tick-rate="))
+		{
+			if (const auto rate = ParseOpt<double>(arg.substr(12)); rate && FixedTimestep::IsValidTickRate(*rate))
+			{
+				tickRate = *rate;
+			}
+			else
+			{
+				Print << U"{}: 0 より大きく {} 以下の数を指定してください"_fmt(arg, FixedTimestep::MaxTickRate);
+			}
+		}
+		else if (arg.starts_with(U"--load-state="))
+		{
+			loadStatePath = arg.substr(13);
+		}
+		else if (arg.starts_with(U"--memory-budget="))
+		{
+			if (const auto budgets = MemoryMonitor::ParseBudgets(arg.substr(16)))
+			{
+				memoryMonitor.setBudgets(*budgets);
+			}
+			else
+			{
+				Print << U"{}: 予算を読めませんでした"_fmt(arg);
+			}
+		}
+	}
+
+	// 最初のシナリオ（と読み込んだ状態）の画像がアトラスから取れるように、ここで待つ
+	GetTextureAtlas().finish();
 
 	EntitySet entities;
 	StateStack stateStack;
+	if (loadStatePath && (not SaveData::Load(*loadStatePath, entities, stateStack)))
+	{
+		Print << U"{}: 読み込みに失敗しました"_fmt(*loadStatePath);
+	}
+	ScenarioReloader scenarioReloader;
+	SimulationPipeline pipeline{ entities, stateStack, tickRate }; // entities・stateStack より先に破棄する
+	FramePacer framePacer;
+	BackgroundLayer backgroundLayer;
 
 	while (System::Update())
 	{
-		stateStack.update(entities);
-		drawEntities(entities);
+#ifdef ENABLE_PROFILER
+		GetFrameProfiler().beginFrame();
+#endif
+
+		// シミュレーションが止まっている間にシナリオとテクスチャを更新する
+		// テクスチャ・フォントの作成と文字の整形はここでまとめて行う（シミュレーションのスレッドでは作らない）
+		pipeline.wait();
+		scenarioReloader.update();
+		GetAssetCache().update();
+		memoryMonitor.update(entities);
+
+		// F5: 保存, F9: 読み込み
+		if (KeyF5.down())
+		{
+			Print << (SaveData::Save(SaveData::DefaultPath, entities, stateStack)
+				? U"{}: 保存しました"_fmt(SaveData::DefaultPath)
+				: U"{}: 保存に失敗しました"_fmt(SaveData::DefaultPath));
+		}
+		if (KeyF9.down())
+		{
+			if (SaveData::Load(SaveData::DefaultPath, entities, stateStack))
+			{
+				pipeline.resetCapture();
+				Print << U"{}: 読み込みました"_fmt(SaveData::DefaultPath);
+			}
+			else
+			{
+				Print << U"{}: 読み込みに失敗しました"_fmt(SaveData::DefaultPath);
+			}
+		}
+
+		// F4: メモリの内訳の書き出し
+		memoryMonitor.handleInput(entities);
+
+		framePacer.update(pipeline.idleSeconds());
+
+		pipeline.start(FrameInput::Sample(), Scene::Rect());
+
+		drawSnapshot(pipeline.front(), Scene::Rect(), backgroundLayer);
+
+#ifdef ENABLE_PROFILER
+		GetFrameProfiler().endFrame(pipeline.front().entityCount);
+
+		GetFrameProfiler().handleInput();
+		GetFrameProfiler().drawOverlay();
+		GetTransitionLog().handleInput();
+		GetTransitionLog().drawView();
+#endif
 
 		Cursor::RequestStyle(CursorStyle::Hidden);
 	}